@@ -44,7 +44,9 @@ uint8_t EEPROMClass::read(int address)
 
 void EEPROMClass::write(int address, uint8_t value)
 {
+	if (writeCallback_) writeCallback_(address);
 	eeprom_write_byte((unsigned char *) address, value);
+	writes++;
 }
 
 EEPROMClass EEPROM;
@@ -27,6 +27,10 @@ class EEPROMClass
   public:
     uint8_t read(int);
     void write(int, uint8_t);
+    void writeCallback(void (*callback)(int address)) { writeCallback_ = callback; }
+    uint32_t writes;    // bytes written since reset
+  private:
+    void (*writeCallback_)(int address);
 };
 
 extern EEPROMClass EEPROM;
@@ -18,11 +18,28 @@
    uint8_t nfilecount=0;
 */
 
+// SdFile slots for open File objects. Bit i of filePoolUsed is set
+// while filePool[i] is in use.
+static SdFile filePool[SD_FILE_POOL_SIZE];
+static uint8_t filePoolUsed = 0;
+
 File::File(SdFile f, const char *n) {
-  // oh man you are kidding me, new() doesnt exist? Ok we do it by hand!
-  _file = (SdFile *)malloc(sizeof(SdFile)); 
-  if (_file) {
-    memcpy(_file, &f, sizeof(SdFile));
+  // take a free slot from the pool - the heap is never used
+  _file = 0;
+  _name[0] = 0;
+  for (uint8_t i = 0; i < SD_FILE_POOL_SIZE; i++) {
+    if (!(filePoolUsed & (1 << i))) {
+      filePoolUsed |= 1 << i;
+      _file = &filePool[i];
+      break;
+    }
+  }
+  if (!_file) {
+    // no free slot - write anything pending and count the failure
+    f.close();
+    SD.allocFailures++;
+  } else {
+    *_file = f;
     
     strncpy(_name, n, 12);
     _name[12] = 0;
@@ -131,7 +148,7 @@ uint32_t File::size() {
 void File::close() {
   if (_file) {
     _file->close();
-    free(_file); 
+    filePoolUsed &= ~(1 << (_file - filePool));
     _file = 0;
 
     /* for debugging file open/close leaks
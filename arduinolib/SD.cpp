@@ -326,6 +326,35 @@ boolean callback_rmdir(SdFile& parentDir, char *filePathComponent,
   return true;
 }
 
+boolean repairFiles(SdFile& dir) {
+  /*
+
+    Recover the size of every file below `dir` that was open for
+    write in lazy metadata mode at an unclean shutdown.  Other files
+    are left alone, their last block was not zero filled by SdFile.
+
+   */
+  dir_t p;
+  dir.rewind();
+  while (dir.readDir(&p) > 0) {
+    // position of next entry - opening by index moves `dir`
+    uint32_t next = dir.curPosition();
+    SdFile f;
+    if (DIR_IS_SUBDIR(&p)) {
+      if (f.open(dir, next / 32 - 1, O_READ)) {
+        if (!repairFiles(f)) return false;
+        f.close();
+      }
+    } else if (p.reservedNT & DIR_NT_LAZY_WRITE) {
+      // close clears the mark
+      if (!f.open(dir, next / 32 - 1, O_RDWR)) return false;
+      if (!f.repairSize() || !f.close()) return false;
+    }
+    if (!dir.seekSet(next)) return false;
+  }
+  return true;
+}
+
 
 
 /* Implementation of class used to create `SDCard` object. */
@@ -341,15 +370,150 @@ boolean SDClass::begin(uint8_t csPin) {
 
    */
   root.close();
-  return card.init(SPI_HALF_SPEED, csPin) &&
-         volume.init(card) &&
-         root.openRoot(volume);
+  dirCacheClear();
+  if (!card.init(SPI_HALF_SPEED, csPin) ||
+      !volume.init(card) ||
+      !root.openRoot(volume)) {
+    return false;
+  }
+  // fix file sizes and the mirror FAT after an unclean shutdown
+  if (volume.uncleanMount()) {
+    return repairFiles(root) && volume.repair();
+  }
+  return true;
+}
+
+void SDClass::lazyMetadata(boolean lazy) {
+  /*
+
+    Defer mirror FAT and directory entry updates until a file is
+    closed or `commit` is called.  See SdVolume::setLazyMetadata().
+
+   */
+  if (lazy) {
+    volume.setLazyMetadata();
+  } else {
+    volume.clearLazyMetadata();
+  }
+}
+
+boolean SDClass::commit(void) {
+  /*
+
+    Write all metadata deferred by lazy metadata mode.
+
+   */
+  return volume.commit();
 }
 
+boolean SDClass::openContiguous(const char *filepath, uint32_t size,
+                                uint32_t *bgnBlock, uint32_t *endBlock) {
+  /*
+
+    Find the blocks of a file whose clusters are contiguous, creating
+    it with `size` bytes if it doesn't exist.  A new file is erased so
+    no stale data from earlier files is left in its blocks.
+
+    The blocks can then be read and written with `sdCard()` without
+    going through the FAT, so the file's directory entry and FAT
+    chain never change after it is created.
+
+   */
+  int pathidx;
+  SdFile parentdir = getParentDir(filepath, &pathidx);
+  filepath += pathidx;
+  if (!parentdir.isOpen() || !filepath[0]) return false;
+
+  SdFile *dir = parentdir.isRoot() ? &root : &parentdir;
+  SdFile file;
+  boolean ok = file.open(dir, filepath, O_READ);
+  if (ok) {
+    ok = file.contiguousRange(bgnBlock, endBlock);
+  } else if (file.createContiguous(dir, filepath, size)
+             && file.contiguousRange(bgnBlock, endBlock)) {
+    // erase or zero the new blocks
+    ok = card.erase(*bgnBlock, *endBlock);
+    uint8_t *zero = SdVolume::cacheClear();
+    if (!ok) {
+      memset(zero, 0, 512);
+      ok = true;
+      for (uint32_t b = *bgnBlock; ok && b <= *endBlock; b++) {
+        ok = card.writeBlock(b, zero);
+      }
+    }
+  }
+  file.close();
+  if (!parentdir.isRoot()) parentdir.close();
+  return ok;
+}
+
+
+
+int8_t SDClass::dirCacheFind(const char *path, size_t len) {
+  /*
+
+    Return the slot holding the directory for the first `len`
+    characters of `path` or -1 if it is not cached.
+
+   */
+  if (len > SD_DIR_CACHE_PATH_LEN) return -1;
+  for (uint8_t i = 0; i < SD_DIR_CACHE_SIZE; i++) {
+    if (dirCache[i].isOpen() && !strncmp(dirCachePath[i], path, len) &&
+        dirCachePath[i][len] == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void SDClass::dirCacheStore(const char *path, size_t len, SdFile& dir) {
+  /*
+
+    Remember `dir` as the directory for the first `len` characters of
+    `path`. Paths too long to store are not cached.
+
+   */
+  if (len > SD_DIR_CACHE_PATH_LEN) return;
+  int8_t i = dirCacheFind(path, len);
+  if (i < 0) {
+    // replace oldest entry
+    i = dirCacheNext;
+    dirCacheNext = (dirCacheNext + 1) % SD_DIR_CACHE_SIZE;
+    strncpy(dirCachePath[i], path, len);
+    dirCachePath[i][len] = 0;
+  }
+  dirCache[i] = dir;
+}
+
+void SDClass::dirCacheClear(void) {
+  /*
+
+    Forget all cached directories. Used when the card is initialised
+    and when directories are created or removed.
+
+   */
+  for (uint8_t i = 0; i < SD_DIR_CACHE_SIZE; i++) {
+    dirCache[i].close();
+  }
+}
 
 
 // this little helper is used to traverse paths
 SdFile SDClass::getParentDir(const char *filepath, int *index) {
+  // files in root don't need a walk
+  const char *name = strrchr(filepath, '/');
+  size_t len = name ? name - filepath : 0;
+  if (strspn(filepath, "/") >= len) {
+    *index = name ? len + 1 : 0;
+    return root;
+  }
+  // reuse a directory found by an earlier call
+  int8_t slot = dirCacheFind(filepath, len);
+  if (slot >= 0) {
+    *index = len + 1;
+    return dirCache[slot];
+  }
+
   // get parent directory
   SdFile d1 = root; // start with the mostparent, root!
   SdFile d2;
@@ -401,6 +565,7 @@ SdFile SDClass::getParentDir(const char *filepath, int *index) {
 
   *index = (int)(filepath - origpath);
   // parent is now the parent diretory of the file!
+  if (!parent->isRoot()) dirCacheStore(origpath, len, *parent);
   return *parent;
 }
 
@@ -460,6 +625,9 @@ File SDClass::open(const char *filepath, uint8_t mode) {
     if ( ! file.open(parentdir, filepath, mode)) {
       return File();
     }
+    // the directory may have grown - keep the cached copy current,
+    // pathidx is past the '/' that ends the directory part
+    dirCacheStore(filepath - pathidx, pathidx - 1, parentdir);
     // close the parent
     parentdir.close();
   }
@@ -545,6 +713,7 @@ boolean SDClass::mkdir(char *filepath) {
     A rough equivalent to `mkdir -p`.
   
    */
+  dirCacheClear();
   return walkPath(filepath, root, callback_makeDirPath);
 }
 
@@ -556,10 +725,12 @@ boolean SDClass::rmdir(char *filepath) {
     A rough equivalent to `mkdir -p`.
   
    */
+  dirCacheClear();
   return walkPath(filepath, root, callback_rmdir);
 }
 
 boolean SDClass::remove(char *filepath) {
+  dirCacheClear();
   return walkPath(filepath, root, callback_remove);
 }
 
@@ -15,7 +15,9 @@
 #ifndef __SD_H__
 #define __SD_H__
 
+#ifdef __AVR__
 #include <Arduino.h>
+#endif  // __AVR__
 
 #include <utility/SdFat.h>
 #include <utility/SdFatUtil.h>
@@ -23,6 +25,22 @@
 #define FILE_READ O_READ
 #define FILE_WRITE (O_READ | O_WRITE | O_CREAT)
 
+// Number of File objects that can be open at once. Slots are allocated
+// statically so opening a file never uses the heap.
+#ifndef SD_FILE_POOL_SIZE
+#define SD_FILE_POOL_SIZE 2
+#endif
+#if SD_FILE_POOL_SIZE > 8
+#error SD_FILE_POOL_SIZE must not be greater than 8
+#endif
+
+// Number of parent directories remembered by `open` and the longest
+// path, without the file name, that will be remembered.
+#ifndef SD_DIR_CACHE_SIZE
+#define SD_DIR_CACHE_SIZE 2
+#endif
+#define SD_DIR_CACHE_PATH_LEN 24
+
 class File : public Stream {
  private:
   char _name[13]; // our name
@@ -63,6 +81,18 @@ private:
   
   // my quick&dirty iterator, should be replaced
   SdFile getParentDir(const char *filepath, int *indx);
+
+  // Parent directories found by `getParentDir` so reopening a file
+  // in a subdirectory doesn't walk the path again.
+  SdFile dirCache[SD_DIR_CACHE_SIZE];
+  char dirCachePath[SD_DIR_CACHE_SIZE][SD_DIR_CACHE_PATH_LEN + 1];
+  uint8_t dirCacheNext;
+  int8_t dirCacheFind(const char *path, size_t len);
+  void dirCacheStore(const char *path, size_t len, SdFile& dir);
+  void dirCacheClear(void);
+
+  // Number of times a File could not get a slot from the pool.
+  uint16_t allocFailures;
 public:
   // This needs to be called to set up the connection to the SD card
   // before other methods are used.
@@ -85,6 +115,25 @@ public:
   
   boolean rmdir(char *filepath);
 
+  // Number of times `open` failed because all SD_FILE_POOL_SIZE
+  // File slots were in use.
+  uint16_t fileAllocFailures(void) { return allocFailures; }
+
+  // Defer mirror FAT and directory updates until files are closed or
+  // `commit` is called. Writes fewer blocks for small appends.
+  void lazyMetadata(boolean lazy);
+
+  // Write metadata deferred by `lazyMetadata` to the card.
+  boolean commit(void);
+
+  // Find the blocks of a contiguous file, creating it if needed, so
+  // it can be used as a fixed region with `sdCard()` block I/O.
+  boolean openContiguous(const char *filepath, uint32_t size,
+                         uint32_t *bgnBlock, uint32_t *endBlock);
+
+  // The card, for block access to a region from `openContiguous`.
+  Sd2Card *sdCard(void) { return &card; }
+
 private:
 
   // This is used to determine the mode used to open a file
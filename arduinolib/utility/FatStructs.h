@@ -28,6 +28,16 @@
  * http://www.microsoft.com/whdc/system/platform/firmware/fatgen.mspx
  */
 //------------------------------------------------------------------------------
+/**
+ * On-disk structures have no padding on AVR.  Host builds, see SdHost.h,
+ * must pack them to match the disk layout.
+ */
+#ifdef __AVR__
+#define FAT_PACKED
+#else  // __AVR__
+#define FAT_PACKED __attribute__((packed))
+#endif  // __AVR__
+//------------------------------------------------------------------------------
 /** Value for byte 510 of boot block or MBR */
 uint8_t const BOOTSIG0 = 0X55;
 /** Value for byte 511 of boot block or MBR */
@@ -90,7 +100,7 @@ struct partitionTable {
   uint32_t firstSector;
            /** Length of the partition, in blocks. */
   uint32_t totalSectors;
-};
+} FAT_PACKED;
 /** Type name for partitionTable */
 typedef struct partitionTable part_t;
 //------------------------------------------------------------------------------
@@ -114,7 +124,7 @@ struct masterBootRecord {
   uint8_t  mbrSig0;
            /** Second MBR signature byte. Must be 0XAA */
   uint8_t  mbrSig1;
-};
+} FAT_PACKED;
 /** Type name for masterBootRecord */
 typedef struct masterBootRecord mbr_t;
 //------------------------------------------------------------------------------
@@ -236,7 +246,7 @@ struct biosParmBlock {
            * should always set all of the bytes of this field to 0.
            */
   uint8_t  fat32Reserved[12];
-};
+} FAT_PACKED;
 /** Type name for biosParmBlock */
 typedef struct biosParmBlock bpb_t;
 //------------------------------------------------------------------------------
@@ -271,7 +281,7 @@ struct fat32BootSector {
   uint8_t  bootSectorSig0;
            /** must be 0XAA */
   uint8_t  bootSectorSig1;
-};
+} FAT_PACKED;
 //------------------------------------------------------------------------------
 // End Of Chain values for FAT entries
 /** FAT16 end of chain value used by Microsoft. */
@@ -284,10 +294,56 @@ uint32_t const FAT32EOC = 0X0FFFFFFF;
 uint32_t const FAT32EOC_MIN = 0X0FFFFFF8;
 /** Mask a for FAT32 entry. Entries are 28 bits. */
 uint32_t const FAT32MASK = 0X0FFFFFFF;
+// Volume dirty flags kept in FAT entry one
+/** FAT16 entry one bit that is set if the volume was cleanly unmounted. */
+uint16_t const FAT16_CLEAN_SHUTDOWN = 0X8000;
+/** FAT32 entry one bit that is set if the volume was cleanly unmounted. */
+uint32_t const FAT32_CLEAN_SHUTDOWN = 0X08000000;
 
 /** Type name for fat32BootSector */
 typedef struct fat32BootSector fbs_t;
 //------------------------------------------------------------------------------
+/** Lead signature for a FAT32 FSINFO block */
+uint32_t const FSINFO_LEAD_SIG = 0X41615252;
+/** Struct signature for a FAT32 FSINFO block */
+uint32_t const FSINFO_STRUCT_SIG = 0X61417272;
+/** Trail signature for a FAT32 FSINFO block */
+uint32_t const FSINFO_TRAIL_SIG = 0XAA550000;
+/** FSINFO freeCount and nextFree value meaning unknown */
+uint32_t const FSINFO_UNKNOWN = 0XFFFFFFFF;
+/**
+ * \struct fat32FSInfo
+ *
+ * \brief FSINFO block for a FAT32 volume
+ *
+ * Holds hints for the free cluster count and the next free cluster.
+ * The values are advisory and must be range checked before use.
+ */
+struct fat32FSInfo {
+           /** must be 0X41615252 */
+  uint32_t leadSignature;
+           /** should always be zero */
+  uint8_t  reserved1[480];
+           /** must be 0X61417272 */
+  uint32_t structSignature;
+          /**
+           * Last known free cluster count on the volume. 0XFFFFFFFF means
+           * the count is unknown and must be computed.
+           */
+  uint32_t freeCount;
+          /**
+           * Cluster number where a search for free clusters should start.
+           * 0XFFFFFFFF means no hint is available.
+           */
+  uint32_t nextFree;
+           /** should always be zero */
+  uint8_t  reserved2[12];
+           /** must be 0XAA550000 */
+  uint32_t tailSignature;
+} FAT_PACKED;
+/** Type name for fat32FSInfo */
+typedef struct fat32FSInfo fsinfo_t;
+//------------------------------------------------------------------------------
 /**
  * \struct directoryEntry
  * \brief FAT short directory entry
@@ -334,7 +390,8 @@ struct directoryEntry {
   uint8_t  attributes;
           /**
            * Reserved for use by Windows NT. Set value to 0 when a file is
-           * created and never modify or look at it after that.
+           * created and never modify or look at it after that.  Windows
+           * only uses bits 3 and 4, SdFile uses DIR_NT_LAZY_WRITE.
            */
   uint8_t  reservedNT;
           /**
@@ -366,7 +423,7 @@ struct directoryEntry {
   uint16_t firstClusterLow;
            /** 32-bit unsigned holding this file's size in bytes. */
   uint32_t fileSize;
-};
+} FAT_PACKED;
 //------------------------------------------------------------------------------
 // Definitions for directory entries
 //
@@ -397,6 +454,11 @@ uint8_t const DIR_ATT_LONG_NAME = 0X0F;
 uint8_t const DIR_ATT_LONG_NAME_MASK = 0X3F;
 /** defined attribute bits */
 uint8_t const DIR_ATT_DEFINED_BITS = 0X3F;
+/**
+ * reservedNT bit set while a file is open for write in lazy metadata
+ * mode, so repair after an unclean shutdown only touches those files
+ */
+uint8_t const DIR_NT_LAZY_WRITE = 0X01;
 /** Directory entry is part of a long name */
 static inline uint8_t DIR_IS_LONG_NAME(const dir_t* dir) {
   return (dir->attributes & DIR_ATT_LONG_NAME_MASK) == DIR_ATT_LONG_NAME;
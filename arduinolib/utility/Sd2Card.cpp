@@ -88,16 +88,32 @@ void spiSend(uint8_t data) {
 }
 #endif  // SOFTWARE_SPI
 //------------------------------------------------------------------------------
+// callback function for busy wait
+void (*Sd2Card::busyCallback_)(void) = 0;
+// callback function around block writes
+void (*Sd2Card::writeCallback_)(uint8_t done) = 0;
+//------------------------------------------------------------------------------
+// I/O counters
+sd_stats_t sdStats;
+//------------------------------------------------------------------------------
 // send command and return error code.  Return zero for OK
 uint8_t Sd2Card::cardCommand(uint8_t cmd, uint32_t arg) {
   // end read if in partialBlockRead mode
   readEnd();
 
+  // end multiple block read started by readStart()
+  if (inStream_ && cmd != CMD12 && !readStop()) return 0XFF;
+
+  // finish write started by writeBlockAsync()
+  if (writeBusy_ && !writeComplete()) return 0XFF;
+
+  sdStats.commands++;
+
   // select card
   chipSelectLow();
 
-  // wait up to 300 ms if busy
-  waitNotBusy(300);
+  // wait up to 300 ms if busy - card is sending data if CMD12
+  if (cmd != CMD12) waitNotBusy(300);
 
   // send command
   spiSend(cmd | 0x40);
@@ -111,6 +127,9 @@ uint8_t Sd2Card::cardCommand(uint8_t cmd, uint32_t arg) {
   if (cmd == CMD8) crc = 0X87;  // correct crc for CMD8 with arg 0X1AA
   spiSend(crc);
 
+  // discard stuff byte sent after CMD12
+  if (cmd == CMD12) spiRec();
+
   // wait for response
   for (uint8_t i = 0; ((status_ = spiRec()) & 0X80) && i != 0XFF; i++);
   return status_;
@@ -211,7 +230,7 @@ uint8_t Sd2Card::eraseSingleBlockEnable(void) {
  * can be determined by calling errorCode() and errorData().
  */
 uint8_t Sd2Card::init(uint8_t sckRateID, uint8_t chipSelectPin) {
-  errorCode_ = inBlock_ = partialBlockRead_ = type_ = 0;
+  errorCode_ = inBlock_ = inStream_ = partialBlockRead_ = type_ = 0;
   chipSelectPin_ = chipSelectPin;
   // 16-bit init start time allows over a minute
   uint16_t t0 = (uint16_t)millis();
@@ -239,12 +258,19 @@ uint8_t Sd2Card::init(uint8_t sckRateID, uint8_t chipSelectPin) {
 
   chipSelectLow();
 
+  // let a write started by writeBlockAsync() finish programming
+  if (writeBusy_) {
+    waitNotBusy(SD_WRITE_TIMEOUT);
+    writeBusy_ = 0;
+  }
+
   // command to go idle in SPI mode
   while ((status_ = cardCommand(CMD0, 0)) != R1_IDLE_STATE) {
     if (((uint16_t)millis() - t0) > SD_INIT_TIMEOUT) {
       error(SD_CARD_ERROR_CMD0);
       goto fail;
     }
+    sdStats.retries++;
   }
   // check SD version
   if ((cardCommand(CMD8, 0x1AA) & R1_ILLEGAL_COMMAND)) {
@@ -267,6 +293,7 @@ uint8_t Sd2Card::init(uint8_t sckRateID, uint8_t chipSelectPin) {
       error(SD_CARD_ERROR_ACMD41);
       goto fail;
     }
+    sdStats.retries++;
   }
   // if SD2 read OCR register to check for SDHC card
   if (type() == SD_CARD_TYPE_SD2) {
@@ -291,6 +318,23 @@ uint8_t Sd2Card::init(uint8_t sckRateID, uint8_t chipSelectPin) {
   return false;
 }
 //------------------------------------------------------------------------------
+/**
+ * Check for a write started by writeBlockAsync() that is still programming.
+ *
+ * The card is polled once.  Call writeComplete() or any other card function
+ * to check the result of the write.
+ *
+ * \return The value one, true, is returned if the card is busy and
+ * the value zero, false, is returned if the card is ready.
+ */
+uint8_t Sd2Card::isBusy(void) {
+  if (!writeBusy_) return false;
+  chipSelectLow();
+  uint8_t busy = spiRec() != 0XFF;
+  chipSelectHigh();
+  return busy;
+}
+//------------------------------------------------------------------------------
 /**
  * Enable or disable partial block reads.
  *
@@ -398,6 +442,56 @@ uint8_t Sd2Card::readData(uint32_t block,
   return false;
 }
 //------------------------------------------------------------------------------
+/**
+ * Read the next 512 byte block of a multiple block read sequence.
+ *
+ * \param[out] dst Pointer to the location that will receive the data.
+ *
+ * \note This function is used with readStart() and readStop()
+ * for optimized multiple block reads.
+ *
+ * \return The value one, true, is returned for success and
+ * the value zero, false, is returned for failure.
+ */
+uint8_t Sd2Card::readData(uint8_t* dst) {
+  if (!inStream_) {
+    error(SD_CARD_ERROR_READ);
+    return false;
+  }
+  if (!waitStartBlock()) goto fail;
+
+#ifdef OPTIMIZE_HARDWARE_SPI
+  // start first spi transfer
+  SPDR = 0XFF;
+
+  // transfer data
+  for (uint16_t i = 0; i < 511; i++) {
+    while (!(SPSR & (1 << SPIF)));
+    dst[i] = SPDR;
+    SPDR = 0XFF;
+  }
+  // wait for last byte
+  while (!(SPSR & (1 << SPIF)));
+  dst[511] = SPDR;
+
+#else  // OPTIMIZE_HARDWARE_SPI
+
+  // transfer data
+  for (uint16_t i = 0; i < 512; i++) {
+    dst[i] = spiRec();
+  }
+#endif  // OPTIMIZE_HARDWARE_SPI
+
+  spiRec();  // get first crc byte
+  spiRec();  // get second crc byte
+  streamBlock_++;
+  return true;
+
+ fail:
+  readStop();
+  return false;
+}
+//------------------------------------------------------------------------------
 /** Skip remaining data in a block when in partial block read mode. */
 void Sd2Card::readEnd(void) {
   if (inBlock_) {
@@ -439,6 +533,55 @@ uint8_t Sd2Card::readRegister(uint8_t cmd, void* buf) {
   return false;
 }
 //------------------------------------------------------------------------------
+/** Start a read multiple blocks sequence.
+ *
+ * \param[in] blockNumber Address of first block in sequence.
+ *
+ * \note This function is used with readData() and readStop()
+ * for optimized multiple block reads.  The card reads ahead while
+ * each block is transferred and the SPI bus must not be used by other
+ * devices until readStop() is called.
+ *
+ * \return The value one, true, is returned for success and
+ * the value zero, false, is returned for failure.
+ */
+uint8_t Sd2Card::readStart(uint32_t blockNumber) {
+  streamBlock_ = blockNumber;
+
+  // use address if not SDHC card
+  if (type()!= SD_CARD_TYPE_SDHC) blockNumber <<= 9;
+  if (cardCommand(CMD18, blockNumber)) {
+    error(SD_CARD_ERROR_CMD18);
+    goto fail;
+  }
+  inStream_ = true;
+  return true;
+
+ fail:
+  chipSelectHigh();
+  return false;
+}
+//------------------------------------------------------------------------------
+/** End a read multiple blocks sequence.
+ *
+ * \return The value one, true, is returned for success and
+ * the value zero, false, is returned for failure.
+ */
+uint8_t Sd2Card::readStop(void) {
+  if (!inStream_) return true;
+  inStream_ = 0;
+  if (cardCommand(CMD12, 0)) {
+    error(SD_CARD_ERROR_CMD12);
+    goto fail;
+  }
+  chipSelectHigh();
+  return true;
+
+ fail:
+  chipSelectHigh();
+  return false;
+}
+//------------------------------------------------------------------------------
 /**
  * Set the SPI clock rate.
  *
@@ -470,12 +613,19 @@ uint8_t Sd2Card::setSckRate(uint8_t sckRateID) {
 //------------------------------------------------------------------------------
 // wait for card to go not busy
 uint8_t Sd2Card::waitNotBusy(uint16_t timeoutMillis) {
+  // don't time a card that is already ready
+  if (spiRec() == 0XFF) return true;
+
   uint16_t t0 = millis();
+  uint32_t u0 = micros();
+  uint8_t ready;
   do {
-    if (spiRec() == 0XFF) return true;
+    if (busyCallback_) busyCallback_();
+    ready = spiRec() == 0XFF;
   }
-  while (((uint16_t)millis() - t0) < timeoutMillis);
-  return false;
+  while (!ready && ((uint16_t)millis() - t0) < timeoutMillis);
+  sdStats.busyMicros += micros() - u0;
+  return ready;
 }
 //------------------------------------------------------------------------------
 /** Wait for start block token */
@@ -507,6 +657,24 @@ uint8_t Sd2Card::waitStartBlock(void) {
  * the value zero, false, is returned for failure.
  */
 uint8_t Sd2Card::writeBlock(uint32_t blockNumber, const uint8_t* src) {
+  return writeBlockAsync(blockNumber, src) && writeComplete();
+}
+//------------------------------------------------------------------------------
+/**
+ * Start writing a 512 byte block to an SD card.
+ *
+ * Returns as soon as the card accepts the data.  The card then programs
+ * the block while the CPU is free.  Use isBusy() to poll for completion
+ * and writeComplete() to wait and check the result.  The next card
+ * command waits for the write to finish and checks its result.
+ *
+ * \param[in] blockNumber Logical block to be written.
+ * \param[in] src Pointer to the location of the data to be written.
+ * \return The value one, true, is returned for success and
+ * the value zero, false, is returned for failure.
+ */
+uint8_t Sd2Card::writeBlockAsync(uint32_t blockNumber, const uint8_t* src) {
+  if (writeCallback_) writeCallback_(0);
 #if SD_PROTECT_BLOCK_ZERO
   // don't allow write to first block
   if (blockNumber == 0) {
@@ -523,6 +691,33 @@ uint8_t Sd2Card::writeBlock(uint32_t blockNumber, const uint8_t* src) {
   }
   if (!writeData(DATA_START_BLOCK, src)) goto fail;
 
+  // card is now programming the block
+  writeBusy_ = true;
+  chipSelectHigh();
+  if (writeCallback_) writeCallback_(1);
+  return true;
+
+ fail:
+  chipSelectHigh();
+  if (writeCallback_) writeCallback_(1);
+  return false;
+}
+//------------------------------------------------------------------------------
+/**
+ * Wait for a write started by writeBlockAsync() to finish and check
+ * that the card programmed the block.
+ *
+ * The busy callback is called while the card is busy.
+ * See busyCallback().
+ *
+ * \return The value one, true, is returned for success and
+ * the value zero, false, is returned for failure.
+ */
+uint8_t Sd2Card::writeComplete(void) {
+  if (!writeBusy_) return true;
+  writeBusy_ = 0;
+  chipSelectLow();
+
   // wait for flash programming to complete
   if (!waitNotBusy(SD_WRITE_TIMEOUT)) {
     error(SD_CARD_ERROR_WRITE_TIMEOUT);
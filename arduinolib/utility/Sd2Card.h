@@ -23,8 +23,13 @@
  * \file
  * Sd2Card class
  */
+#ifdef __AVR__
 #include "Sd2PinMap.h"
+#else  // __AVR__
+#include "SdHost.h"
+#endif  // __AVR__
 #include "SdInfo.h"
+#include "SdStats.h"
 /** Set SCK to max rate of F_CPU/2. See Sd2Card::setSckRate(). */
 uint8_t const SPI_FULL_SPEED = 0;
 /** Set SCK rate to F_CPU/4. See Sd2Card::setSckRate(). */
@@ -136,6 +141,10 @@ uint8_t const SD_CARD_ERROR_WRITE_PROGRAMMING = 0X14;
 uint8_t const SD_CARD_ERROR_WRITE_TIMEOUT = 0X15;
 /** incorrect rate selected */
 uint8_t const SD_CARD_ERROR_SCK_RATE = 0X16;
+/** card returned an error response for CMD18 (read multiple block) */
+uint8_t const SD_CARD_ERROR_CMD18 = 0X17;
+/** card returned an error response for CMD12 (stop transmission) */
+uint8_t const SD_CARD_ERROR_CMD12 = 0X18;
 //------------------------------------------------------------------------------
 // card types
 /** Standard capacity V1 SD card */
@@ -152,7 +161,35 @@ uint8_t const SD_CARD_TYPE_SDHC = 3;
 class Sd2Card {
  public:
   /** Construct an instance of Sd2Card. */
-  Sd2Card(void) : errorCode_(0), inBlock_(0), partialBlockRead_(0), type_(0) {}
+  Sd2Card(void) : errorCode_(0), inBlock_(0), inStream_(0),
+    partialBlockRead_(0), type_(0), writeBusy_(0) {}
+  /**
+   * Set a function to be called while the card is busy.
+   *
+   * \param[in] busy The user's callback function.  It is called each time
+   * the card is polled and found busy, for example to put the CPU in
+   * idle sleep until the next timer interrupt.  The card is selected
+   * during the call so the function must not use the SPI bus.
+   */
+  static void busyCallback(void (*busy)(void)) {
+    busyCallback_ = busy;
+  }
+  /**
+   * Cancel the busy callback function.
+   */
+  static void busyCallbackCancel(void) {
+    busyCallback_ = 0;
+  }
+  /**
+   * Set a function to be called around each block write.
+   *
+   * \param[in] write The user's callback function.  It is called with
+   * zero before the write command and with one when the card has
+   * accepted the data, or the write failed.  It must not use the SPI bus.
+   */
+  static void writeCallback(void (*write)(uint8_t done)) {
+    writeCallback_ = write;
+  }
   uint32_t cardSize(void);
   uint8_t erase(uint32_t firstBlock, uint32_t lastBlock);
   uint8_t eraseSingleBlockEnable(void);
@@ -178,12 +215,21 @@ class Sd2Card {
     return init(sckRateID, SD_CHIP_SELECT_PIN);
   }
   uint8_t init(uint8_t sckRateID, uint8_t chipSelectPin);
+  uint8_t isBusy(void);
   void partialBlockRead(uint8_t value);
   /** Returns the current value, true or false, for partial block read. */
   uint8_t partialBlockRead(void) const {return partialBlockRead_;}
   uint8_t readBlock(uint32_t block, uint8_t* dst);
   uint8_t readData(uint32_t block,
           uint16_t offset, uint16_t count, uint8_t* dst);
+  uint8_t readData(uint8_t* dst);
+  /**
+   * \return True if \a block is the next block of the multiple block
+   * read started by readStart().
+   */
+  uint8_t readContinues(uint32_t block) const {
+    return inStream_ && block == streamBlock_;
+  }
   /**
    * Read a cards CID register. The CID contains card identification
    * information such as Manufacturer ID, Product name, Product serial
@@ -198,10 +244,14 @@ class Sd2Card {
     return readRegister(CMD9, csd);
   }
   void readEnd(void);
+  uint8_t readStart(uint32_t blockNumber);
+  uint8_t readStop(void);
   uint8_t setSckRate(uint8_t sckRateID);
   /** Return the card type: SD V1, SD V2 or SDHC */
   uint8_t type(void) const {return type_;}
   uint8_t writeBlock(uint32_t blockNumber, const uint8_t* src);
+  uint8_t writeBlockAsync(uint32_t blockNumber, const uint8_t* src);
+  uint8_t writeComplete(void);
   uint8_t writeData(const uint8_t* src);
   uint8_t writeStart(uint32_t blockNumber, uint32_t eraseCount);
   uint8_t writeStop(void);
@@ -210,10 +260,15 @@ class Sd2Card {
   uint8_t chipSelectPin_;
   uint8_t errorCode_;
   uint8_t inBlock_;
+  uint8_t inStream_;
   uint16_t offset_;
   uint8_t partialBlockRead_;
   uint8_t status_;
+  uint32_t streamBlock_;
   uint8_t type_;
+  uint8_t writeBusy_;
+  static void (*busyCallback_)(void);
+  static void (*writeCallback_)(uint8_t done);
   // private functions
   uint8_t cardAcmd(uint8_t cmd, uint32_t arg) {
     cardCommand(CMD55, 0);
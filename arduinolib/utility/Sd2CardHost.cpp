@@ -0,0 +1,330 @@
+/* Arduino Sd2Card Library
+ * Copyright (C) 2009 by William Greiman
+ *
+ * This file is part of the Arduino Sd2Card Library
+ *
+ * This Library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This Library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with the Arduino Sd2Card Library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+/*
+ * Sd2Card for host builds.  The card is a FAT16 or FAT32 image file that
+ * is memory mapped, so every accepted block write reaches the file.
+ * Command latency, program busy time and power cuts are set in sdHost,
+ * see SdHost.h.  Build on Linux with something like:
+ *
+ *   g++ -Iarduinolib app.cpp arduinolib/SD.cpp arduinolib/File.cpp \
+ *     arduinolib/utility/SdVolume.cpp arduinolib/utility/SdFile.cpp \
+ *     arduinolib/utility/Sd2CardHost.cpp
+ */
+#ifndef __AVR__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "Sd2Card.h"
+//------------------------------------------------------------------------------
+// Arduino core replacements
+HostSerial Serial;
+
+static uint64_t hostMicros(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+uint32_t micros(void) {return hostMicros();}
+uint32_t millis(void) {return hostMicros() / 1000;}
+void delay(uint32_t ms) {usleep(ms * 1000UL);}
+//------------------------------------------------------------------------------
+// virtual card state
+sd_host_t sdHost;
+sd_stats_t sdStats;
+void (*Sd2Card::busyCallback_)(void) = 0;
+void (*Sd2Card::writeCallback_)(uint8_t done) = 0;
+
+static uint8_t* image = 0;       // mapped image file
+static uint32_t imageBlocks = 0;  // size of image in blocks
+static uint64_t busyEnd = 0;     // time the last write finishes programming
+
+/** \return The address of \a block in the image or zero if out of range */
+static uint8_t* imageBlock(uint32_t block) {
+  return image && block < imageBlocks ? image + 512UL * block : 0;
+}
+/** \return True if the card is still programming the last block written */
+static uint8_t programming(void) {
+  return hostMicros() < busyEnd;
+}
+/** Program a block - fails once the simulated power cut happens */
+static uint8_t programBlock(uint32_t block, const uint8_t* src) {
+  uint8_t* dst = imageBlock(block);
+  if (!dst || sdHost.powerCut) return false;
+  if (sdHost.writesBeforeCut && sdHost.writeCount >= sdHost.writesBeforeCut) {
+    sdHost.powerCut = true;
+    return false;
+  }
+  memcpy(dst, src, 512);
+  sdHost.writeCount++;
+  busyEnd = hostMicros() + sdHost.busyMicros;
+  return true;
+}
+//------------------------------------------------------------------------------
+// count and delay a command.  Return zero for OK
+uint8_t Sd2Card::cardCommand(uint8_t cmd, uint32_t /* arg */) {
+  // end read if in partialBlockRead mode
+  readEnd();
+
+  // end multiple block read started by readStart()
+  if (inStream_ && cmd != CMD12 && !readStop()) return 0XFF;
+
+  // finish write started by writeBlockAsync()
+  if (writeBusy_ && !writeComplete()) return 0XFF;
+
+  sdStats.commands++;
+  if (sdHost.commandMicros) usleep(sdHost.commandMicros);
+  status_ = image ? 0 : 0XFF;
+  return status_;
+}
+//------------------------------------------------------------------------------
+/**
+ * Determine the size of the card image.
+ *
+ * \return The number of 512 byte data blocks in the image
+ *         or zero if no image is open.
+ */
+uint32_t Sd2Card::cardSize(void) {
+  return imageBlocks;
+}
+//------------------------------------------------------------------------------
+void Sd2Card::chipSelectHigh(void) {}
+//------------------------------------------------------------------------------
+void Sd2Card::chipSelectLow(void) {}
+//------------------------------------------------------------------------------
+/** Erase a range of blocks to zero.  See Sd2Card.cpp. */
+uint8_t Sd2Card::erase(uint32_t firstBlock, uint32_t lastBlock) {
+  if (cardCommand(CMD38, 0) || !imageBlock(lastBlock)
+    || firstBlock > lastBlock || sdHost.powerCut) {
+    error(SD_CARD_ERROR_ERASE);
+    return false;
+  }
+  memset(imageBlock(firstBlock), 0, 512UL * (lastBlock - firstBlock + 1));
+  return true;
+}
+//------------------------------------------------------------------------------
+/** The virtual card can erase single blocks. */
+uint8_t Sd2Card::eraseSingleBlockEnable(void) {
+  return true;
+}
+//------------------------------------------------------------------------------
+/**
+ * Open and map the image named by sdHost.image.  A mapped image is kept
+ * so init() can be called again to remount after a simulated power cut.
+ *
+ * \return The value one, true, is returned for success and
+ * the value zero, false, is returned for failure.
+ */
+uint8_t Sd2Card::init(uint8_t sckRateID, uint8_t chipSelectPin) {
+  errorCode_ = inBlock_ = inStream_ = partialBlockRead_ = 0;
+  chipSelectPin_ = chipSelectPin;
+
+  // power is restored - a write in progress at the cut is lost
+  writeBusy_ = 0;
+  busyEnd = 0;
+  sdHost.powerCut = 0;
+  sdHost.writeCount = 0;
+
+  if (!image) {
+    struct stat st;
+    int fd = sdHost.image ? open(sdHost.image, O_RDWR) : -1;
+    if (fd < 0) goto fail;
+    if (fstat(fd, &st) || st.st_size < 512) {
+      close(fd);
+      goto fail;
+    }
+    void* p = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) goto fail;
+    image = static_cast<uint8_t*>(p);
+    imageBlocks = st.st_size / 512;
+  }
+  if (cardCommand(CMD0, 0)) goto fail;
+  type(SD_CARD_TYPE_SDHC);
+  return setSckRate(sckRateID);
+
+ fail:
+  error(SD_CARD_ERROR_CMD0);
+  return false;
+}
+//------------------------------------------------------------------------------
+/** Check for busy with CMD13.  See Sd2Card.cpp. */
+uint8_t Sd2Card::isBusy(void) {
+  return programming();
+}
+//------------------------------------------------------------------------------
+/** Enable or disable partial block reads.  See Sd2Card.cpp. */
+void Sd2Card::partialBlockRead(uint8_t value) {
+  readEnd();
+  partialBlockRead_ = value;
+}
+//------------------------------------------------------------------------------
+/** Read a 512 byte block from the image.  See Sd2Card.cpp. */
+uint8_t Sd2Card::readBlock(uint32_t block, uint8_t* dst) {
+  return readData(block, 0, 512, dst);
+}
+//------------------------------------------------------------------------------
+/** Read part of a 512 byte block from the image.  See Sd2Card.cpp. */
+uint8_t Sd2Card::readData(uint32_t block,
+        uint16_t offset, uint16_t count, uint8_t* dst) {
+  if (count == 0) return true;
+  if ((count + offset) > 512) return false;
+  if (!inBlock_ || block != block_ || offset < offset_) {
+    block_ = block;
+    if (cardCommand(CMD17, block) || !imageBlock(block)) {
+      error(SD_CARD_ERROR_CMD17);
+      return false;
+    }
+    inBlock_ = 1;
+  }
+  memcpy(dst, imageBlock(block) + offset, count);
+  offset_ = offset + count;
+  if (!partialBlockRead_ || offset_ >= 512) readEnd();
+  return true;
+}
+//------------------------------------------------------------------------------
+/** Read the next block of a multiple block read.  See Sd2Card.cpp. */
+uint8_t Sd2Card::readData(uint8_t* dst) {
+  if (!inStream_ || !imageBlock(streamBlock_)) {
+    error(SD_CARD_ERROR_READ);
+    return false;
+  }
+  memcpy(dst, imageBlock(streamBlock_), 512);
+  streamBlock_++;
+  return true;
+}
+//------------------------------------------------------------------------------
+/** Skip remaining data in a block when in partial block read mode. */
+void Sd2Card::readEnd(void) {
+  inBlock_ = 0;
+}
+//------------------------------------------------------------------------------
+/** The virtual card has no CID or CSD - \a buf is cleared. */
+uint8_t Sd2Card::readRegister(uint8_t cmd, void* buf) {
+  if (cardCommand(cmd, 0)) {
+    error(SD_CARD_ERROR_READ_REG);
+    return false;
+  }
+  memset(buf, 0, 16);
+  return true;
+}
+//------------------------------------------------------------------------------
+/** Start a multiple block read.  See Sd2Card.cpp. */
+uint8_t Sd2Card::readStart(uint32_t blockNumber) {
+  if (cardCommand(CMD18, blockNumber)) {
+    error(SD_CARD_ERROR_CMD18);
+    return false;
+  }
+  inStream_ = true;
+  streamBlock_ = blockNumber;
+  return true;
+}
+//------------------------------------------------------------------------------
+/** End a multiple block read.  See Sd2Card.cpp. */
+uint8_t Sd2Card::readStop(void) {
+  if (!inStream_) return true;
+  inStream_ = 0;
+  if (cardCommand(CMD12, 0)) {
+    error(SD_CARD_ERROR_CMD12);
+    return false;
+  }
+  return true;
+}
+//------------------------------------------------------------------------------
+/** Check the SPI rate selector.  Timing is set by sdHost. */
+uint8_t Sd2Card::setSckRate(uint8_t sckRateID) {
+  if (sckRateID > 6) {
+    error(SD_CARD_ERROR_SCK_RATE);
+    return false;
+  }
+  return true;
+}
+//------------------------------------------------------------------------------
+// wait for the card to finish programming
+uint8_t Sd2Card::waitNotBusy(uint16_t /* timeoutMillis */) {
+  if (!programming()) return true;
+  uint64_t t0 = hostMicros();
+  while (programming()) {
+    if (busyCallback_) busyCallback_();
+  }
+  sdStats.busyMicros += hostMicros() - t0;
+  return true;
+}
+//------------------------------------------------------------------------------
+/** Write a 512 byte block to the image.  See Sd2Card.cpp. */
+uint8_t Sd2Card::writeBlock(uint32_t blockNumber, const uint8_t* src) {
+  return writeBlockAsync(blockNumber, src) && writeComplete();
+}
+//------------------------------------------------------------------------------
+/** Start writing a 512 byte block.  See Sd2Card.cpp. */
+uint8_t Sd2Card::writeBlockAsync(uint32_t blockNumber, const uint8_t* src) {
+  if (writeCallback_) writeCallback_(0);
+#if SD_PROTECT_BLOCK_ZERO
+  // don't allow write to first block
+  if (blockNumber == 0) {
+    error(SD_CARD_ERROR_WRITE_BLOCK_ZERO);
+    if (writeCallback_) writeCallback_(1);
+    return false;
+  }
+#endif  // SD_PROTECT_BLOCK_ZERO
+  if (cardCommand(CMD24, blockNumber) || !programBlock(blockNumber, src)) {
+    error(SD_CARD_ERROR_CMD24);
+    if (writeCallback_) writeCallback_(1);
+    return false;
+  }
+  writeBusy_ = true;
+  if (writeCallback_) writeCallback_(1);
+  return true;
+}
+//------------------------------------------------------------------------------
+/** Wait for a write started by writeBlockAsync().  See Sd2Card.cpp. */
+uint8_t Sd2Card::writeComplete(void) {
+  if (!writeBusy_) return true;
+  writeBusy_ = 0;
+  return waitNotBusy(SD_WRITE_TIMEOUT);
+}
+//------------------------------------------------------------------------------
+/** Write one block of a multiple block write.  See Sd2Card.cpp. */
+uint8_t Sd2Card::writeData(const uint8_t* src) {
+  waitNotBusy(SD_WRITE_TIMEOUT);
+  if (!programBlock(block_, src)) {
+    error(SD_CARD_ERROR_WRITE_MULTIPLE);
+    return false;
+  }
+  block_++;
+  return true;
+}
+//------------------------------------------------------------------------------
+/** Start a multiple block write.  See Sd2Card.cpp. */
+uint8_t Sd2Card::writeStart(uint32_t blockNumber, uint32_t /* eraseCount */) {
+  if (cardCommand(CMD25, blockNumber)) {
+    error(SD_CARD_ERROR_CMD25);
+    return false;
+  }
+  block_ = blockNumber;
+  return true;
+}
+//------------------------------------------------------------------------------
+/** End a multiple block write.  See Sd2Card.cpp. */
+uint8_t Sd2Card::writeStop(void) {
+  return waitNotBusy(SD_WRITE_TIMEOUT);
+}
+#endif  // __AVR__
@@ -23,10 +23,14 @@
  * \file
  * SdFile and SdVolume classes
  */
+#ifdef __AVR__
 #include <avr/pgmspace.h>
+#endif  // __AVR__
 #include "Sd2Card.h"
 #include "FatStructs.h"
+#ifdef __AVR__
 #include "Print.h"
+#endif  // __AVR__
 //------------------------------------------------------------------------------
 /**
  * Allow use of deprecated functions if non-zero
@@ -142,6 +146,8 @@ class SdFile : public Print {
    * for true after calls to print() and/or write().
    */
   //bool writeError;
+  uint8_t* appendBuffer(uint16_t* avail);
+  uint8_t appendCommit(uint16_t count);
   /**
    * Cancel unbuffered reads for this file.
    * See setUnbufferedRead()
@@ -150,6 +156,7 @@ class SdFile : public Print {
     flags_ &= ~F_FILE_UNBUFFERED_READ;
   }
   uint8_t close(void);
+  uint8_t commit(void);
   uint8_t contiguousRange(uint32_t* bgnBlock, uint32_t* endBlock);
   uint8_t createContiguous(SdFile* dirFile,
           const char* fileName, uint32_t size);
@@ -242,6 +249,7 @@ class SdFile : public Print {
   int8_t readDir(dir_t* dir);
   static uint8_t remove(SdFile* dirFile, const char* fileName);
   uint8_t remove(void);
+  uint8_t repairSize(void);
   /** Set the file's current position to zero. */
   void rewind(void) {
     curPosition_ = curCluster_ = 0;
@@ -368,15 +376,18 @@ class SdFile : public Print {
   // bits defined in flags_
   // should be 0XF
   static uint8_t const F_OFLAG = (O_ACCMODE | O_APPEND | O_SYNC);
-  // available bits
-  static uint8_t const F_UNUSED = 0X30;
+  // directory entry has DIR_NT_LAZY_WRITE set
+  static uint8_t const F_FILE_LAZY_MARK = 0X10;
+  // sync of directory entry required in lazy metadata mode
+  static uint8_t const F_FILE_DIR_FORCE = 0X20;
   // use unbuffered SD read
   static uint8_t const F_FILE_UNBUFFERED_READ = 0X40;
   // sync of directory entry required
   static uint8_t const F_FILE_DIR_DIRTY = 0X80;
 
 // make sure F_OFLAG is ok
-#if ((F_UNUSED | F_FILE_UNBUFFERED_READ | F_FILE_DIR_DIRTY) & F_OFLAG)
+#if ((F_FILE_LAZY_MARK | F_FILE_DIR_FORCE | F_FILE_UNBUFFERED_READ |\
+  F_FILE_DIR_DIRTY) & F_OFLAG)
 #error flags_ bits conflict
 #endif  // flags_ bits
 
@@ -418,8 +429,29 @@ union cache_t {
   mbr_t    mbr;
            /** Used to access to a cached FAT boot sector. */
   fbs_t    fbs;
+           /** Used to access a cached FAT32 FSINFO block. */
+  fsinfo_t fsinfo;
 };
 //------------------------------------------------------------------------------
+/**
+ * Number of free cluster extents remembered by SdVolume.  Clusters
+ * released by freeChain() are kept here so the next allocation does not
+ * have to search the FAT for them.
+ */
+uint8_t const SD_FREE_EXTENT_COUNT = 4;
+/**
+ * \struct freeExtent
+ * \brief A run of free clusters
+ */
+struct freeExtent {
+           /** First cluster of the run. */
+  uint32_t start;
+           /** Number of clusters in the run, zero for an unused slot. */
+  uint32_t count;
+};
+/** Type name for freeExtent */
+typedef struct freeExtent extent_t;
+//------------------------------------------------------------------------------
 /**
  * \class SdVolume
  * \brief Access FAT16 and FAT32 volumes on SD and SDHC cards.
@@ -427,7 +459,10 @@ union cache_t {
 class SdVolume {
  public:
   /** Create an instance of SdVolume */
-  SdVolume(void) :allocSearchStart_(2), fatType_(0) {}
+  SdVolume(void) :allocSearchStart_(2), fatType_(0),
+    freeClusterCount_(FSINFO_UNKNOWN), fsInfoBlock_(0), fsInfoDirty_(0),
+    lazy_(0), unclean_(0), volumeDirty_(0), mirrorFirst_(0XFFFFFFFF),
+    mirrorLast_(0) {}
   /** Clear the cache and returns a pointer to the cache.  Used by the WaveRP
    *  recorder to do raw write to the SD card.  Not for normal apps.
    */
@@ -436,6 +471,34 @@ class SdVolume {
     cacheBlockNumber_ = 0XFFFFFFFF;
     return cacheBuffer_.data;
   }
+  /** Read a block of \a card into the cache, unless it is already there,
+   *  and return a pointer to the cache or zero for failure.  Raw blocks
+   *  written without the cache must be written with cacheClear() first.
+   *  Not for normal apps.
+   */
+  static uint8_t* cacheRead(Sd2Card* card, uint32_t blockNumber);
+  /** Write the cached block if it was changed.  Not for normal apps.
+   *
+   * \return The value one, true, is returned for success and
+   * the value zero, false, is returned for failure.
+   */
+  static uint8_t cacheSync(void) {return cacheFlush();}
+  /** Like cacheRead() but the block is marked changed, so it is written
+   *  by cacheSync() or before the cache is used for another block.
+   *  Not for normal apps.
+   */
+  static uint8_t* cacheWrite(Sd2Card* card, uint32_t blockNumber);
+  /**
+   * Leave lazy metadata mode.  Deferred updates are written by commit().
+   *
+   * \return The value one, true, is returned for success and
+   * the value zero, false, is returned for failure.
+   */
+  uint8_t clearLazyMetadata(void) {
+    lazy_ = 0;
+    return commit();
+  }
+  uint8_t commit(void);
   /**
    * Initialize a FAT volume.  Try partition one first then try super
    * floppy format.
@@ -467,6 +530,11 @@ class SdVolume {
   uint32_t fatStartBlock(void) const {return fatStartBlock_;}
   /** \return The FAT type of the volume. Values are 12, 16 or 32. */
   uint8_t fatType(void) const {return fatType_;}
+  /** \return The number of free clusters in the volume. */
+  uint32_t freeClusterCount(void);
+  /** \return True if lazy metadata mode is enabled. */
+  uint8_t lazyMetadata(void) const {return lazy_;}
+  uint8_t repair(void);
   /** \return The number of entries in the root directory for FAT16 volumes. */
   uint32_t rootDirEntryCount(void) const {return rootDirEntryCount_;}
   /** \return The logical block number for the start of the root directory
@@ -474,6 +542,23 @@ class SdVolume {
   uint32_t rootDirStart(void) const {return rootDirStart_;}
   /** return a pointer to the Sd2Card object for this volume */
   static Sd2Card* sdCard(void) {return sdCard_;}
+  /**
+   * Enter lazy metadata mode.
+   *
+   * Writes to the mirror FAT are deferred until commit() and SdFile::sync()
+   * only rewrites a directory entry when the file's first cluster changes,
+   * its size moves into a new block or DIR_NT_LAZY_WRITE is first set.  The volume is marked dirty in
+   * FAT[1] until the next commit() so an unclean shutdown can be detected
+   * and repaired by the next init().
+   */
+  void setLazyMetadata(void) {lazy_ = true;}
+  /**
+   * \return True if the volume was not committed before it was last
+   * removed or powered off.  Call repair() to fix the mirror FAT and
+   * SdFile::repairSize() for each file that was open for write, those
+   * whose directory entry has DIR_NT_LAZY_WRITE set.
+   */
+  uint8_t uncleanMount(void) const {return unclean_;}
 //------------------------------------------------------------------------------
 #if ALLOW_DEPRECATED_FUNCTIONS
   // Deprecated functions  - suppress cpplint warnings with NOLINT comment
@@ -494,12 +579,16 @@ class SdVolume {
   static uint8_t const CACHE_FOR_READ = 0;
   // value for action argument in cacheRawBlock to indicate cache dirty
   static uint8_t const CACHE_FOR_WRITE = 1;
+  // flag for action argument in cacheRawBlock to count block as directory
+  static uint8_t const CACHE_FOR_DIR = 2;
 
   static cache_t cacheBuffer_;        // 512 byte cache for device blocks
   static uint32_t cacheBlockNumber_;  // Logical number of block in the cache
   static Sd2Card* sdCard_;            // Sd2Card object for cache
   static uint8_t cacheDirty_;         // cacheFlush() will write block if true
   static uint32_t cacheMirrorBlock_;  // block number for mirror FAT
+  static uint8_t cacheClass_;         // I/O counter class of cached block
+  static SdVolume* cacheVolume_;      // volume used to classify blocks
 //
   uint32_t allocSearchStart_;   // start cluster for alloc search
   uint8_t blocksPerCluster_;    // cluster size in blocks
@@ -512,6 +601,15 @@ class SdVolume {
   uint8_t fatType_;             // volume type (12, 16, OR 32)
   uint16_t rootDirEntryCount_;  // number of entries in FAT16 root dir
   uint32_t rootDirStart_;       // root start block for FAT16, cluster for FAT32
+  uint32_t freeClusterCount_;   // free clusters or FSINFO_UNKNOWN
+  uint32_t fsInfoBlock_;        // FAT32 FSINFO block, zero if none
+  uint8_t fsInfoDirty_;         // fsInfoSync() will write FSINFO if true
+  extent_t freeExtent_[SD_FREE_EXTENT_COUNT];  // recently freed clusters
+  uint8_t lazy_;                // defer mirror FAT and dir entry updates
+  uint8_t unclean_;             // volume was dirty when init() was called
+  uint8_t volumeDirty_;         // FAT[1] clean shutdown bit is clear
+  uint32_t mirrorFirst_;        // first FAT block not yet mirrored
+  uint32_t mirrorLast_;         // last FAT block not yet mirrored
   //----------------------------------------------------------------------------
   uint8_t allocContiguous(uint32_t count, uint32_t* curCluster);
   uint8_t blockOfCluster(uint32_t position) const {
@@ -522,6 +620,8 @@ class SdVolume {
            return clusterStartBlock(cluster) + blockOfCluster(position);}
   static uint8_t cacheFlush(void);
   static uint8_t cacheRawBlock(uint32_t blockNumber, uint8_t action);
+  static uint8_t cacheStreamBlock(uint32_t blockNumber);
+  static void cacheSetDir(void) {cacheClass_ = SD_IO_DIR;}
   static void cacheSetDirty(void) {cacheDirty_ |= CACHE_FOR_WRITE;}
   static uint8_t cacheZeroBlock(uint32_t blockNumber);
   uint8_t chainSize(uint32_t beginCluster, uint32_t* size) const;
@@ -530,18 +630,45 @@ class SdVolume {
   uint8_t fatPutEOC(uint32_t cluster) {
     return fatPut(cluster, 0x0FFFFFFF);
   }
+  uint8_t fatSetClean(uint8_t clean);
+  void freeCountAdd(int32_t delta) {
+    if (freeClusterCount_ != FSINFO_UNKNOWN) freeClusterCount_ += delta;
+    fsInfoDirty_ = true;
+  }
   uint8_t freeChain(uint32_t cluster);
+  void freeExtentAdd(uint32_t start, uint32_t count);
+  uint8_t freeExtentTake(uint32_t count, uint32_t* bgnCluster);
+  uint8_t freeRange(uint32_t bgnCluster, uint32_t count);
+  uint8_t fsInfoSync(void);
+  static uint8_t ioClass(uint32_t block);
   uint8_t isEOC(uint32_t cluster) const {
     return  cluster >= (fatType_ == 16 ? FAT16EOC_MIN : FAT32EOC_MIN);
   }
+  uint8_t markDirty(void) {return volumeDirty_ || fatSetClean(false);}
+  void mirrorDefer(uint32_t lba) {
+    if (lba < mirrorFirst_) mirrorFirst_ = lba;
+    if (lba > mirrorLast_) mirrorLast_ = lba;
+  }
   uint8_t readBlock(uint32_t block, uint8_t* dst) {
-    return sdCard_->readBlock(block, dst);}
+    if (!sdCard_->readBlock(block, dst)) return false;
+    sdStats.blocksRead[ioClass(block)]++;
+    return true;
+  }
   uint8_t readData(uint32_t block, uint16_t offset,
     uint16_t count, uint8_t* dst) {
+      // count a partial block read once, when it starts
+      if (offset == 0 || !sdCard_->partialBlockRead()) {
+        sdStats.blocksRead[ioClass(block)]++;
+      }
       return sdCard_->readData(block, offset, count, dst);
   }
+  static uint8_t readStop(void) {return sdCard_->readStop();}
+  static uint8_t readStream(uint32_t block, uint8_t* dst);
+  // card programs the block while the next command is prepared
   uint8_t writeBlock(uint32_t block, const uint8_t* dst) {
-    return sdCard_->writeBlock(block, dst);
+    if (!sdCard_->writeBlockAsync(block, dst)) return false;
+    sdStats.blocksWritten[ioClass(block)]++;
+    return true;
   }
 };
 #endif  // SdFat_h
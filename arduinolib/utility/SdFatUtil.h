@@ -23,8 +23,12 @@
  * \file
  * Useful utility functions.
  */
+#ifdef __AVR__
 #include <Arduino.h>
 #include <avr/pgmspace.h>
+#else  // __AVR__
+#include "SdHost.h"
+#endif  // __AVR__
 /** Store and print a string in flash memory.*/
 #define PgmPrint(x) SerialPrint_P(PSTR(x))
 /** Store and print a string in flash memory followed by a CR/LF.*/
@@ -33,6 +37,7 @@
 #define NOINLINE __attribute__((noinline,unused))
 #define UNUSEDOK __attribute__((unused))
 //------------------------------------------------------------------------------
+#ifdef __AVR__
 /** Return the number of bytes currently free in RAM. */
 static UNUSEDOK int FreeRam(void) {
   extern int  __bss_end;
@@ -49,6 +54,7 @@ static UNUSEDOK int FreeRam(void) {
   }
   return free_memory;
 }
+#endif  // __AVR__
 //------------------------------------------------------------------------------
 /**
  * %Print a string in flash memory to the serial port.
@@ -18,8 +18,10 @@
  * <http://www.gnu.org/licenses/>.
  */
 #include "SdFat.h"
+#ifdef __AVR__
 #include <avr/pgmspace.h>
 #include <Arduino.h>
+#endif  // __AVR__
 //------------------------------------------------------------------------------
 // callback function for date/time
 void (*SdFile::dateTime_)(uint16_t* date, uint16_t* time) = NULL;
@@ -36,7 +38,7 @@ uint8_t SdFile::addCluster() {
   // if first cluster of file link to directory entry
   if (firstCluster_ == 0) {
     firstCluster_ = curCluster_;
-    flags_ |= F_FILE_DIR_DIRTY;
+    flags_ |= F_FILE_DIR_DIRTY | F_FILE_DIR_FORCE;
   }
   return true;
 }
@@ -50,15 +52,129 @@ uint8_t SdFile::addDirCluster(void) {
   uint32_t block = vol_->clusterStartBlock(curCluster_);
   for (uint8_t i = vol_->blocksPerCluster_; i != 0; i--) {
     if (!SdVolume::cacheZeroBlock(block + i - 1)) return false;
+    SdVolume::cacheSetDir();
   }
   // Increase directory file size by cluster size
   fileSize_ += 512UL << vol_->clusterSizeShift_;
   return true;
 }
 //------------------------------------------------------------------------------
+/**
+ * Get a pointer to free space at the end of a file.
+ *
+ * The pointer is into the volume cache which holds the file's last block.
+ * Store up to \a avail bytes there then call appendCommit() to add them
+ * to the file.  No other file or volume function may be called between
+ * the two calls.
+ *
+ * A new last block is zero filled in the cache, not read from the card.
+ * A partly filled last block stays in the cache between records unless
+ * sync() writes the directory entry, which needs the cache.  In lazy
+ * metadata mode that only happens at the first sync() after the end of
+ * file moves into a new block, so repairSize() can find the block.  See
+ * SdVolume::setLazyMetadata().
+ *
+ * \param[out] avail The number of bytes that may be stored.
+ *
+ * \return A pointer into the cache or null for failure.  Reasons for
+ * failure include the file is not open for write or an I/O error.
+ */
+uint8_t* SdFile::appendBuffer(uint16_t* avail) {
+  // error if not a normal file or is read-only
+  if (!isFile() || !(flags_ & O_WRITE)) return NULL;
+
+  // always append at end of file
+  if (curPosition_ != fileSize_ && !seekEnd()) return NULL;
+
+  uint8_t blockOfCluster = vol_->blockOfCluster(curPosition_);
+  uint16_t blockOffset = curPosition_ & 0X1FF;
+  uint32_t cluster = curCluster_;
+  if (blockOffset == 0) {
+    if (blockOfCluster == 0) {
+      // find or add cluster - curCluster_ is set by appendCommit()
+      if (cluster == 0) {
+        if (firstCluster_ == 0) {
+          // allocate first cluster of file
+          if (!vol_->allocContiguous(1, &cluster)) return NULL;
+          firstCluster_ = cluster;
+          flags_ |= F_FILE_DIR_DIRTY | F_FILE_DIR_FORCE;
+        }
+        cluster = firstCluster_;
+      } else {
+        uint32_t next;
+        if (!vol_->fatGet(cluster, &next)) return NULL;
+        if (vol_->isEOC(next)) {
+          // add cluster if at end of chain
+          if (!vol_->allocContiguous(1, &cluster)) return NULL;
+        } else {
+          cluster = next;
+        }
+      }
+    }
+  }
+  uint32_t block = vol_->clusterStartBlock(cluster) + blockOfCluster;
+  if (blockOffset == 0) {
+    // new block - zero fill and don't read from card
+    if (SdVolume::cacheBlockNumber_ == block) {
+      memset(SdVolume::cacheBuffer_.data, 0, 512);
+    } else if (!SdVolume::cacheZeroBlock(block)) {
+      return NULL;
+    }
+  } else {
+    if (!SdVolume::cacheRawBlock(block, SdVolume::CACHE_FOR_WRITE)) {
+      return NULL;
+    }
+  }
+  SdVolume::cacheSetDirty();
+  *avail = 512 - blockOffset;
+  return SdVolume::cacheBuffer_.data + blockOffset;
+}
+//------------------------------------------------------------------------------
+/**
+ * Add bytes stored at the pointer returned by appendBuffer() to the file.
+ *
+ * \param[in] count The number of bytes stored.
+ *
+ * \return The value one, true, is returned for success and
+ * the value zero, false, is returned for failure.
+ * Reasons for failure include \a count is larger than the space returned
+ * by appendBuffer(), the cache no longer holds the block or an I/O error.
+ */
+uint8_t SdFile::appendCommit(uint16_t count) {
+  if (!isFile() || !(flags_ & O_WRITE) || curPosition_ != fileSize_) {
+    return false;
+  }
+  if (count == 0) return true;
+  uint16_t blockOffset = curPosition_ & 0X1FF;
+  if (count > (512 - blockOffset)) return false;
+
+  // block must still be in the cache
+  uint32_t block = SdVolume::cacheBlockNumber_;
+  if (blockOffset == 0 && vol_->blockOfCluster(curPosition_) == 0) {
+    // first byte in cluster found by appendBuffer()
+    if (block < vol_->dataStartBlock_) return false;
+    curCluster_ = ((block - vol_->dataStartBlock_) >> vol_->clusterSizeShift_)
+                  + 2;
+  }
+  if (block != vol_->blockNumber(curCluster_, curPosition_)) return false;
+
+  // lazy sync must update dir entry if end of file is in a new block
+  if (fileSize_ == 0 ||
+    ((fileSize_ - 1) >> 9) != ((curPosition_ + count - 1) >> 9)) {
+    flags_ |= F_FILE_DIR_FORCE;
+  }
+  curPosition_ += count;
+  fileSize_ = curPosition_;
+  flags_ |= F_FILE_DIR_DIRTY;
+
+  if (flags_ & O_SYNC) return sync();
+  return true;
+}
+//------------------------------------------------------------------------------
 // cache a file's directory entry
 // return pointer to cached entry or null for failure
 dir_t* SdFile::cacheDirEntry(uint8_t action) {
+  action |= SdVolume::CACHE_FOR_DIR;
   if (!SdVolume::cacheRawBlock(dirBlock_, action)) return NULL;
   return SdVolume::cacheBuffer_.dir + dirIndex_;
 }
@@ -72,11 +188,31 @@ dir_t* SdFile::cacheDirEntry(uint8_t action) {
  * Reasons for failure include no file is open or an I/O error.
  */
 uint8_t SdFile::close(void) {
+  // size is exact after this sync - drop the lazy write mark
+  if (flags_ & F_FILE_LAZY_MARK) {
+    flags_ &= ~F_FILE_LAZY_MARK;
+    flags_ |= F_FILE_DIR_DIRTY;
+  }
+  // write directory entry even in lazy metadata mode
+  flags_ |= F_FILE_DIR_FORCE;
   if (!sync())return false;
   type_ = FAT_FILE_TYPE_CLOSED;
   return true;
 }
 //------------------------------------------------------------------------------
+/**
+ * Write this file's directory entry and all metadata deferred by lazy
+ * metadata mode on its volume.  See SdVolume::commit().
+ *
+ * \return The value one, true, is returned for success and
+ * the value zero, false, is returned for failure.
+ * Reasons for failure include no file is open or an I/O error.
+ */
+uint8_t SdFile::commit(void) {
+  flags_ |= F_FILE_DIR_FORCE;
+  return sync() && vol_->commit();
+}
+//------------------------------------------------------------------------------
 /**
  * Check for contiguous file and return its raw block range.
  *
@@ -311,7 +447,8 @@ uint8_t SdFile::makeDir(SdFile* dir, const char* dirName) {
 
   // cache block for '.'  and '..'
   uint32_t block = vol_->clusterStartBlock(firstCluster_);
-  if (!SdVolume::cacheRawBlock(block, SdVolume::CACHE_FOR_WRITE)) return false;
+  if (!SdVolume::cacheRawBlock(block,
+    SdVolume::CACHE_FOR_WRITE | SdVolume::CACHE_FOR_DIR)) return false;
 
   // copy '.' to block
   memcpy(&SdVolume::cacheBuffer_.dir[0], &d, sizeof(d));
@@ -441,8 +578,11 @@ uint8_t SdFile::open(SdFile* dirFile, const char* fileName, uint8_t oflag) {
 
   // set timestamps
   if (dateTime_) {
-    // call user function
-    dateTime_(&p->creationDate, &p->creationTime);
+    // call user function - entry fields are packed so use locals
+    uint16_t date, time;
+    dateTime_(&date, &time);
+    p->creationDate = date;
+    p->creationTime = time;
   } else {
     // use default date/time
     p->creationDate = FAT_DEFAULT_DATE;
@@ -528,6 +668,11 @@ uint8_t SdFile::openCachedEntry(uint8_t dirIndex, uint8_t oflag) {
   // save open flags for read/write
   flags_ = oflag & (O_ACCMODE | O_SYNC | O_APPEND);
 
+  // a mark left by an unclean shutdown is cleared when the file is closed
+  if ((oflag & O_WRITE) && (p->reservedNT & DIR_NT_LAZY_WRITE)) {
+    flags_ |= F_FILE_LAZY_MARK;
+  }
+
   // set to start of file
   curCluster_ = 0;
   curPosition_ = 0;
@@ -692,14 +837,30 @@ int16_t SdFile::read(void* buf, uint16_t nbyte) {
     // amount to be read from current block
     if (n > (512 - offset)) n = 512 - offset;
 
+    // sequential access - use a multiple block read for the new block
+    // directory scans are interleaved with entry updates so don't stream
+    uint8_t stream = offset == 0 && curPosition_ != 0 && !isDir();
+
     // no buffering needed if n == 512 or user requests no buffering
     if ((unbufferedRead() || n == 512) &&
       block != SdVolume::cacheBlockNumber_) {
-      if (!vol_->readData(block, offset, n, dst)) return -1;
+      if (stream && n == 512) {
+        // whole block goes directly to caller
+        if (!SdVolume::readStream(block, dst)) return -1;
+      } else {
+        if (!vol_->readData(block, offset, n, dst)) return -1;
+      }
       dst += n;
     } else {
       // read block to cache and copy data to caller
-      if (!SdVolume::cacheRawBlock(block, SdVolume::CACHE_FOR_READ)) return -1;
+      if (stream) {
+        if (!SdVolume::cacheStreamBlock(block)) return -1;
+      } else {
+        if (!SdVolume::cacheRawBlock(block, isDir() ?
+          SdVolume::CACHE_FOR_DIR : SdVolume::CACHE_FOR_READ)) {
+          return -1;
+        }
+      }
       uint8_t* src = SdVolume::cacheBuffer_.data + offset;
       uint8_t* end = src + n;
       while (src != end) *dst++ = *src++;
@@ -789,6 +950,45 @@ uint8_t SdFile::remove(void) {
   return SdVolume::cacheFlush();
 }
 //------------------------------------------------------------------------------
+/**
+ * Recover the size of a file after an unclean shutdown in lazy metadata
+ * mode.
+ *
+ * The directory entry records a size in the last block written by the
+ * file.  Appended data that was not recorded is found by scanning the
+ * rest of that block, which was zero filled when it was created, for
+ * the last nonzero byte.  Data that ends in zero bytes is truncated.
+ * Clusters allocated past the end of the file are freed.
+ *
+ * \return The value one, true, is returned for success and
+ * the value zero, false, is returned for failure.
+ * Reasons for failure include the file is not open for write or
+ * an I/O error.
+ */
+uint8_t SdFile::repairSize(void) {
+  // error if not a normal file or read-only
+  if (!isFile() || !(flags_ & O_WRITE)) return false;
+
+  // remember position
+  uint32_t pos = curPosition_;
+
+  uint16_t offset = fileSize_ & 0X1FF;
+  if (offset) {
+    if (!seekSet(fileSize_)) return false;
+    uint32_t block = vol_->blockNumber(curCluster_, curPosition_);
+    if (!SdVolume::cacheRawBlock(block, SdVolume::CACHE_FOR_READ)) {
+      return false;
+    }
+    // find last nonzero byte after recorded end of file
+    uint16_t end = 512;
+    while (end > offset && !SdVolume::cacheBuffer_.data[end - 1]) end--;
+    fileSize_ += end - offset;
+  }
+  // free clusters past end of file and write directory entry
+  if (!truncate(fileSize_)) return false;
+  return seekSet(pos);
+}
+//------------------------------------------------------------------------------
 /**
  * Remove a file.
  *
@@ -896,7 +1096,7 @@ uint8_t SdFile::rmRfStar(void) {
       if (!f.remove()) return false;
     }
     // position to next entry if required
-    if (curPosition_ != (32*(index + 1))) {
+    if (curPosition_ != (32UL*(index + 1))) {
       if (!seekSet(32*(index + 1))) return false;
     }
   }
@@ -949,6 +1149,10 @@ uint8_t SdFile::seekSet(uint32_t pos) {
  * The sync() call causes all modified data and directory fields
  * to be written to the storage device.
  *
+ * In lazy metadata mode the directory entry is only written if the first
+ * cluster changed or the end of file moved to a new block.  See
+ * SdVolume::setLazyMetadata().
+ *
  * \return The value one, true, is returned for success and
  * the value zero, false, is returned for failure.
  * Reasons for failure include a call to sync() before a file has been
@@ -958,6 +1162,24 @@ uint8_t SdFile::sync(void) {
   // only allow open files and directories
   if (!isOpen()) return false;
 
+  // release the SPI bus if a multiple block read is active
+  if (!SdVolume::readStop()) return false;
+
+  if (vol_->lazy_ && !(flags_ & F_FILE_DIR_FORCE)) {
+    if ((flags_ & F_FILE_DIR_DIRTY) && !vol_->markDirty()) return false;
+    if (!isFile() || !(flags_ & F_FILE_DIR_DIRTY)
+      || (flags_ & F_FILE_LAZY_MARK)) {
+      // defer directory entry and FSINFO until commit
+      return SdVolume::cacheFlush();
+    }
+    // first deferred update writes the entry with DIR_NT_LAZY_WRITE
+    // so repair after an unclean shutdown knows to check the file
+    flags_ |= F_FILE_LAZY_MARK;
+  } else if (!vol_->lazy_ && (flags_ & F_FILE_LAZY_MARK)) {
+    // lazy mode ended - the entry is exact from now on
+    flags_ &= ~F_FILE_LAZY_MARK;
+    flags_ |= F_FILE_DIR_DIRTY;
+  }
   if (flags_ & F_FILE_DIR_DIRTY) {
     dir_t* d = cacheDirEntry(SdVolume::CACHE_FOR_WRITE);
     if (!d) return false;
@@ -969,15 +1191,26 @@ uint8_t SdFile::sync(void) {
     d->firstClusterLow = firstCluster_ & 0XFFFF;
     d->firstClusterHigh = firstCluster_ >> 16;
 
+    if (flags_ & F_FILE_LAZY_MARK) {
+      d->reservedNT |= DIR_NT_LAZY_WRITE;
+    } else {
+      d->reservedNT &= ~DIR_NT_LAZY_WRITE;
+    }
+
     // set modify time if user supplied a callback date/time function
     if (dateTime_) {
-      dateTime_(&d->lastWriteDate, &d->lastWriteTime);
-      d->lastAccessDate = d->lastWriteDate;
+      uint16_t date, time;
+      dateTime_(&date, &time);
+      d->lastWriteDate = date;
+      d->lastWriteTime = time;
+      d->lastAccessDate = date;
     }
     // clear directory dirty
     flags_ &= ~F_FILE_DIR_DIRTY;
   }
-  return SdVolume::cacheFlush();
+  flags_ &= ~F_FILE_DIR_FORCE;
+  if (vol_->lazy_) return SdVolume::cacheFlush();
+  return SdVolume::cacheFlush() && vol_->fsInfoSync();
 }
 //------------------------------------------------------------------------------
 /**
@@ -1097,7 +1330,7 @@ uint8_t SdFile::truncate(uint32_t length) {
   fileSize_ = length;
 
   // need to update directory entry
-  flags_ |= F_FILE_DIR_DIRTY;
+  flags_ |= F_FILE_DIR_DIRTY | F_FILE_DIR_FORCE;
 
   if (!sync()) return false;
 
@@ -1178,23 +1411,26 @@ size_t SdFile::write(const void* buf, uint16_t nbyte) {
     } else {
       if (blockOffset == 0 && curPosition_ >= fileSize_) {
         // start of new block don't need to read into cache
-        if (!SdVolume::cacheFlush()) goto writeErrorReturn;
-        SdVolume::cacheBlockNumber_ = block;
-        SdVolume::cacheSetDirty();
+        // zero fill so repairSize() can find the end of data
+        if (!SdVolume::cacheZeroBlock(block)) goto writeErrorReturn;
       } else {
         // rewrite part of block
         if (!SdVolume::cacheRawBlock(block, SdVolume::CACHE_FOR_WRITE)) {
           goto writeErrorReturn;
         }
       }
-      uint8_t* dst = SdVolume::cacheBuffer_.data + blockOffset;
-      uint8_t* end = dst + n;
-      while (dst != end) *dst++ = *src++;
+      memcpy(SdVolume::cacheBuffer_.data + blockOffset, src, n);
+      src += n;
     }
     nToWrite -= n;
     curPosition_ += n;
   }
   if (curPosition_ > fileSize_) {
+    // lazy sync must update dir entry if end of file is in a new block
+    if (fileSize_ == 0 ||
+      ((fileSize_ - 1) >> 9) != ((curPosition_ - 1) >> 9)) {
+      flags_ |= F_FILE_DIR_FORCE;
+    }
     // update fileSize and insure sync will update dir entry
     fileSize_ = curPosition_;
     flags_ |= F_FILE_DIR_DIRTY;
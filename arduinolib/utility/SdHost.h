@@ -0,0 +1,164 @@
+/* Arduino SdFat Library
+ * Copyright (C) 2009 by William Greiman
+ *
+ * This file is part of the Arduino SdFat Library
+ *
+ * This Library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This Library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with the Arduino SdFat Library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+#ifndef SdHost_h
+#define SdHost_h
+/**
+ * \file
+ * Host build support
+ *
+ * Replaces the parts of the Arduino core used by Sd2Card, SdVolume,
+ * SdFile and SDClass so the library can run on Linux.  The card is a
+ * FAT image file, see Sd2CardHost.cpp.
+ */
+#ifdef __AVR__
+#error SdHost.h is for host builds only
+#endif  // __AVR__
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+//------------------------------------------------------------------------------
+// program memory is ordinary memory on the host
+#define PROGMEM
+#define PGM_P const char*
+#define PSTR(s) (s)
+#define pgm_read_byte(p) (*(const uint8_t*)(p))
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+// SPI pins normally from Sd2PinMap.h - only used as numbers on the host
+/** SS pin */
+uint8_t const SS_PIN = 10;
+/** MOSI pin */
+uint8_t const MOSI_PIN = 11;
+/** MISO pin */
+uint8_t const MISO_PIN = 12;
+/** SCK pin */
+uint8_t const SCK_PIN = 13;
+
+uint32_t millis(void);
+uint32_t micros(void);
+void delay(uint32_t ms);
+//------------------------------------------------------------------------------
+/**
+ * \class Print
+ * \brief Subset of the Arduino Print class used by the SD library.
+ */
+class Print {
+ public:
+  Print() : writeError_(0) {}
+  virtual size_t write(uint8_t) = 0;
+  virtual size_t write(const uint8_t* buf, size_t size) {
+    size_t n = 0;
+    while (size--) n += write(*buf++);
+    return n;
+  }
+  size_t write(const char* str) {
+    return write(reinterpret_cast<const uint8_t*>(str), strlen(str));
+  }
+  size_t print(const char* str) {return write(str);}
+  size_t print(char c) {return write((uint8_t)c);}
+  size_t print(int n, int base = 10) {return print((long)n, base);}
+  size_t print(unsigned n, int base = 10) {
+    return print((unsigned long)n, base);
+  }
+  size_t print(long n, int base = 10) {
+    if (n < 0 && base == 10) return print('-') + print(-(unsigned long)n);
+    return print((unsigned long)n, base);
+  }
+  size_t print(unsigned long n, int base = 10) {
+    char buf[8 * sizeof(long) + 1];
+    char* str = &buf[sizeof(buf) - 1];
+    *str = 0;
+    if (base < 2) base = 10;
+    do {
+      uint8_t d = n % base;
+      *--str = d < 10 ? '0' + d : 'A' + d - 10;
+      n /= base;
+    } while (n);
+    return write(str);
+  }
+  size_t println(void) {return write("\r\n");}
+  template <typename T> size_t println(T v) {return print(v) + println();}
+  int getWriteError(void) {return writeError_;}
+  void clearWriteError(void) {writeError_ = 0;}
+
+ protected:
+  void setWriteError(int err = 1) {writeError_ = err;}
+
+ private:
+  int writeError_;
+};
+//------------------------------------------------------------------------------
+/**
+ * \class Stream
+ * \brief Subset of the Arduino Stream class used by the SD library.
+ */
+class Stream : public Print {
+ public:
+  virtual int available(void) = 0;
+  virtual int read(void) = 0;
+  virtual int peek(void) = 0;
+  virtual void flush(void) = 0;
+};
+//------------------------------------------------------------------------------
+/**
+ * \class HostSerial
+ * \brief Serial output to stdout for SdFile::ls() and friends.
+ */
+class HostSerial : public Print {
+ public:
+  size_t write(uint8_t b) {return putchar(b) == EOF ? 0 : 1;}
+  using Print::write;
+};
+/** Serial port replacement, defined in Sd2CardHost.cpp */
+extern HostSerial Serial;
+//------------------------------------------------------------------------------
+/**
+ * \struct sdHostConfig
+ * \brief Virtual card settings
+ *
+ * Set the fields before Sd2Card::init().  Timing is added with real
+ * delays so busy callbacks and throughput can be measured.
+ */
+struct sdHostConfig {
+              /** Path of the FAT16 or FAT32 image file. */
+  const char* image;
+              /** Microseconds added to each command. */
+  uint32_t    commandMicros;
+              /** Microseconds the card is busy after each block write. */
+  uint32_t    busyMicros;
+              /**
+               * Block writes accepted before a simulated power cut, zero
+               * for none.  After the cut all writes fail and nothing more
+               * reaches the image until Sd2Card::init() is called.
+               */
+  uint32_t    writesBeforeCut;
+              /** Block writes accepted since Sd2Card::init(). */
+  uint32_t    writeCount;
+              /** True after a simulated power cut. */
+  uint8_t     powerCut;
+};
+/** Type name for sdHostConfig */
+typedef struct sdHostConfig sd_host_t;
+/** Virtual card settings, defined in Sd2CardHost.cpp */
+extern sd_host_t sdHost;
+#endif  // SdHost_h
@@ -0,0 +1,76 @@
+/* Arduino SdFat Library
+ * Copyright (C) 2009 by William Greiman
+ *
+ * This file is part of the Arduino SdFat Library
+ *
+ * This Library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This Library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with the Arduino SdFat Library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+#ifndef SdStats_h
+#define SdStats_h
+/**
+ * \file
+ * I/O counters for Sd2Card, SdVolume and SdFile
+ */
+#include <stdint.h>
+#include <string.h>
+//------------------------------------------------------------------------------
+// block classes for the blocksRead and blocksWritten counters
+/** Block is in the first FAT or the reserved area before it. */
+uint8_t const SD_IO_FAT = 0;
+/** Block is in the second FAT. */
+uint8_t const SD_IO_MIRROR = 1;
+/** Block holds directory entries. */
+uint8_t const SD_IO_DIR = 2;
+/** Block holds file data. */
+uint8_t const SD_IO_DATA = 3;
+/** Number of block classes. */
+uint8_t const SD_IO_CLASS_COUNT = 4;
+//------------------------------------------------------------------------------
+/**
+ * \struct sdStats
+ * \brief Counters for SD card I/O
+ *
+ * Counting starts at reset and continues until sdStatsReset() is called.
+ */
+struct sdStats {
+           /** Commands sent to the card. */
+  uint32_t commands;
+           /** CMD0 and ACMD41 commands repeated while the card starts. */
+  uint32_t retries;
+           /** Microseconds spent waiting for the card to go not busy. */
+  uint32_t busyMicros;
+           /** SdVolume::cacheRawBlock() requests for the cached block. */
+  uint32_t cacheHits;
+           /** SdVolume::cacheRawBlock() requests that read the card. */
+  uint32_t cacheMisses;
+           /** Blocks read from the card by class, index with SD_IO_*. */
+  uint32_t blocksRead[SD_IO_CLASS_COUNT];
+           /** Blocks written to the card by class, index with SD_IO_*. */
+  uint32_t blocksWritten[SD_IO_CLASS_COUNT];
+};
+/** Type name for sdStats */
+typedef struct sdStats sd_stats_t;
+//------------------------------------------------------------------------------
+/** I/O counters, defined in Sd2Card.cpp */
+extern sd_stats_t sdStats;
+/** Copy the I/O counters to \a dst. */
+static inline void sdStatsSnapshot(sd_stats_t* dst) {
+  memcpy(dst, &sdStats, sizeof(sdStats));
+}
+/** Set all I/O counters to zero. */
+static inline void sdStatsReset(void) {
+  memset(&sdStats, 0, sizeof(sdStats));
+}
+#endif  // SdStats_h
@@ -26,55 +26,56 @@ cache_t  SdVolume::cacheBuffer_;     // 512 byte cache for Sd2Card
 Sd2Card* SdVolume::sdCard_;          // pointer to SD card object
 uint8_t  SdVolume::cacheDirty_ = 0;  // cacheFlush() will write block if true
 uint32_t SdVolume::cacheMirrorBlock_ = 0;  // mirror  block for second FAT
+uint8_t  SdVolume::cacheClass_ = SD_IO_DATA;  // I/O counter class of block
+SdVolume* SdVolume::cacheVolume_ = 0;  // volume for I/O counter classes
 //------------------------------------------------------------------------------
 // find a contiguous group of clusters
 uint8_t SdVolume::allocContiguous(uint32_t count, uint32_t* curCluster) {
   // start of group
   uint32_t bgnCluster;
 
-  // flag to save place to start next search
-  uint8_t setStart;
+  // end of group
+  uint32_t endCluster;
 
-  // set search start cluster
-  if (*curCluster) {
-    // try to make file contiguous
+  if (*curCluster && freeRange(*curCluster + 1, count)) {
+    // file can be extended in place
     bgnCluster = *curCluster + 1;
-
-    // don't save new start location
-    setStart = false;
-  } else {
+  } else if (!freeExtentTake(count, &bgnCluster)) {
     // start at likely place for free cluster
     bgnCluster = allocSearchStart_;
+    endCluster = bgnCluster;
 
-    // save next search start if one cluster
-    setStart = 1 == count;
-  }
-  // end of group
-  uint32_t endCluster = bgnCluster;
+    // last cluster of FAT
+    uint32_t fatEnd = clusterCount_ + 1;
 
-  // last cluster of FAT
-  uint32_t fatEnd = clusterCount_ + 1;
+    // search the FAT for free clusters
+    for (uint32_t n = 0;; n++, endCluster++) {
+      // can't find space checked all clusters
+      if (n >= clusterCount_) return false;
 
-  // search the FAT for free clusters
-  for (uint32_t n = 0;; n++, endCluster++) {
-    // can't find space checked all clusters
-    if (n >= clusterCount_) return false;
+      // past end - start from beginning of FAT
+      if (endCluster > fatEnd) {
+        bgnCluster = endCluster = 2;
+      }
+      uint32_t f;
+      if (!fatGet(endCluster, &f)) return false;
 
-    // past end - start from beginning of FAT
-    if (endCluster > fatEnd) {
-      bgnCluster = endCluster = 2;
-    }
-    uint32_t f;
-    if (!fatGet(endCluster, &f)) return false;
-
-    if (f != 0) {
-      // cluster in use try next cluster as bgnCluster
-      bgnCluster = endCluster + 1;
-    } else if ((endCluster - bgnCluster + 1) == count) {
-      // done - found space
-      break;
+      if (f != 0) {
+        // remember free run that was too short for this request
+        freeExtentAdd(bgnCluster, endCluster - bgnCluster);
+
+        // cluster in use try next cluster as bgnCluster
+        bgnCluster = endCluster + 1;
+      } else if ((endCluster - bgnCluster + 1) == count) {
+        // done - found space
+        break;
+      }
     }
+    // remember possible next free cluster
+    allocSearchStart_ = endCluster < fatEnd ? endCluster + 1 : 2;
   }
+  endCluster = bgnCluster + count - 1;
+
   // mark end of chain
   if (!fatPutEOC(endCluster)) return false;
 
@@ -90,22 +91,23 @@ uint8_t SdVolume::allocContiguous(uint32_t count, uint32_t* curCluster) {
   // return first cluster number to caller
   *curCluster = bgnCluster;
 
-  // remember possible next free cluster
-  if (setStart) allocSearchStart_ = bgnCluster + 1;
-
+  freeCountAdd(-(int32_t)count);
   return true;
 }
 //------------------------------------------------------------------------------
 uint8_t SdVolume::cacheFlush(void) {
   if (cacheDirty_) {
-    if (!sdCard_->writeBlock(cacheBlockNumber_, cacheBuffer_.data)) {
+    // don't wait for programming - the next card command checks the write
+    if (!sdCard_->writeBlockAsync(cacheBlockNumber_, cacheBuffer_.data)) {
       return false;
     }
+    sdStats.blocksWritten[cacheClass_]++;
     // mirror FAT tables
     if (cacheMirrorBlock_) {
-      if (!sdCard_->writeBlock(cacheMirrorBlock_, cacheBuffer_.data)) {
+      if (!sdCard_->writeBlockAsync(cacheMirrorBlock_, cacheBuffer_.data)) {
         return false;
       }
+      sdStats.blocksWritten[SD_IO_MIRROR]++;
       cacheMirrorBlock_ = 0;
     }
     cacheDirty_ = 0;
@@ -118,8 +120,41 @@ uint8_t SdVolume::cacheRawBlock(uint32_t blockNumber, uint8_t action) {
     if (!cacheFlush()) return false;
     if (!sdCard_->readBlock(blockNumber, cacheBuffer_.data)) return false;
     cacheBlockNumber_ = blockNumber;
+    cacheClass_ = action & CACHE_FOR_DIR ? SD_IO_DIR : ioClass(blockNumber);
+    sdStats.cacheMisses++;
+    sdStats.blocksRead[cacheClass_]++;
+  } else {
+    sdStats.cacheHits++;
+    if (action & CACHE_FOR_DIR) cacheClass_ = SD_IO_DIR;
+  }
+  cacheDirty_ |= action & CACHE_FOR_WRITE;
+  return true;
+}
+//------------------------------------------------------------------------------
+uint8_t* SdVolume::cacheRead(Sd2Card* card, uint32_t blockNumber) {
+  // raw mode reads blocks without mounting a volume
+  if (sdCard_ != card) {
+    if (!cacheFlush()) return 0;
+    cacheBlockNumber_ = 0XFFFFFFFF;
+    sdCard_ = card;
+  }
+  return cacheRawBlock(blockNumber, CACHE_FOR_READ) ? cacheBuffer_.data : 0;
+}
+//------------------------------------------------------------------------------
+uint8_t* SdVolume::cacheWrite(Sd2Card* card, uint32_t blockNumber) {
+  uint8_t* p = cacheRead(card, blockNumber);
+  if (p) cacheSetDirty();
+  return p;
+}
+//------------------------------------------------------------------------------
+// cache a block read by a multiple block read sequence
+uint8_t SdVolume::cacheStreamBlock(uint32_t blockNumber) {
+  if (cacheBlockNumber_ != blockNumber) {
+    if (!cacheFlush()) return false;
+    if (!readStream(blockNumber, cacheBuffer_.data)) return false;
+    cacheBlockNumber_ = blockNumber;
+    cacheClass_ = ioClass(blockNumber);
   }
-  cacheDirty_ |= action;
   return true;
 }
 //------------------------------------------------------------------------------
@@ -132,6 +167,7 @@ uint8_t SdVolume::cacheZeroBlock(uint32_t blockNumber) {
     cacheBuffer_.data[i] = 0;
   }
   cacheBlockNumber_ = blockNumber;
+  cacheClass_ = ioClass(blockNumber);
   cacheSetDirty();
   return true;
 }
@@ -147,6 +183,34 @@ uint8_t SdVolume::chainSize(uint32_t cluster, uint32_t* size) const {
   return true;
 }
 //------------------------------------------------------------------------------
+/**
+ * Write metadata updates deferred by lazy metadata mode.
+ *
+ * FAT blocks changed since the last commit are copied to the mirror FAT,
+ * the FAT32 FSINFO block is updated and the volume is marked clean.
+ *
+ * \return The value one, true, is returned for success and
+ * the value zero, false, is returned for failure.
+ */
+uint8_t SdVolume::commit(void) {
+  // copy changed range of primary FAT to mirror FAT
+  for (uint32_t lba = mirrorFirst_; lba <= mirrorLast_; lba++) {
+    if (!cacheRawBlock(lba, CACHE_FOR_READ)) return false;
+    if (!writeBlock(lba + blocksPerFat_, cacheBuffer_.data)) return false;
+  }
+  mirrorFirst_ = 0XFFFFFFFF;
+  mirrorLast_ = 0;
+
+  if (!fsInfoSync()) return false;
+
+  // mark clean last so a partial commit is found by the next init()
+  if (volumeDirty_) {
+    if (!fatSetClean(true)) return false;
+    if (fatCount_ > 1) cacheMirrorBlock_ = fatStartBlock_ + blocksPerFat_;
+  }
+  return cacheFlush();
+}
+//------------------------------------------------------------------------------
 // Fetch a FAT entry
 uint8_t SdVolume::fatGet(uint32_t cluster, uint32_t* value) const {
   if (cluster > (clusterCount_ + 1)) return false;
@@ -171,6 +235,9 @@ uint8_t SdVolume::fatPut(uint32_t cluster, uint32_t value) {
   // error if not in FAT
   if (cluster > (clusterCount_ + 1)) return false;
 
+  // volume must be marked dirty before the mirror FAT is out of date
+  if (lazy_ && fatCount_ > 1 && !markDirty()) return false;
+
   // calculate block address for entry
   uint32_t lba = fatStartBlock_;
   lba += fatType_ == 16 ? cluster >> 8 : cluster >> 7;
@@ -186,15 +253,69 @@ uint8_t SdVolume::fatPut(uint32_t cluster, uint32_t value) {
   }
   cacheSetDirty();
 
-  // mirror second FAT
-  if (fatCount_ > 1) cacheMirrorBlock_ = lba + blocksPerFat_;
+  // mirror second FAT now or at commit() in lazy mode
+  if (fatCount_ > 1) {
+    if (lazy_) {
+      mirrorDefer(lba);
+    } else {
+      cacheMirrorBlock_ = lba + blocksPerFat_;
+    }
+  }
   return true;
 }
 //------------------------------------------------------------------------------
+// set or clear the clean shutdown bit in FAT entry one
+uint8_t SdVolume::fatSetClean(uint8_t clean) {
+  if (fatType_ == 12) return true;
+  if (!cacheRawBlock(fatStartBlock_, CACHE_FOR_WRITE)) return false;
+  if (fatType_ == 16) {
+    if (clean) {
+      cacheBuffer_.fat16[1] |= FAT16_CLEAN_SHUTDOWN;
+    } else {
+      cacheBuffer_.fat16[1] &= ~FAT16_CLEAN_SHUTDOWN;
+    }
+  } else {
+    if (clean) {
+      cacheBuffer_.fat32[1] |= FAT32_CLEAN_SHUTDOWN;
+    } else {
+      cacheBuffer_.fat32[1] &= ~FAT32_CLEAN_SHUTDOWN;
+    }
+  }
+  if (!clean && fatCount_ > 1) mirrorDefer(fatStartBlock_);
+  volumeDirty_ = !clean;
+
+  // dirty mark must be on the card before any update is deferred
+  return clean || cacheFlush();
+}
+//------------------------------------------------------------------------------
+/**
+ * Return the number of free clusters in the volume.
+ *
+ * The count is taken from the FAT32 FSINFO block when it is valid and
+ * is maintained as clusters are allocated and freed.  Otherwise the FAT
+ * is scanned once and the result is remembered.
+ *
+ * \return The number of free clusters or 0XFFFFFFFF if an I/O error occurs.
+ */
+uint32_t SdVolume::freeClusterCount(void) {
+  if (freeClusterCount_ == FSINFO_UNKNOWN) {
+    uint32_t free = 0;
+    for (uint32_t c = 2; c <= (clusterCount_ + 1); c++) {
+      uint32_t f;
+      if (!fatGet(c, &f)) return FSINFO_UNKNOWN;
+      if (f == 0) free++;
+    }
+    freeClusterCount_ = free;
+    fsInfoDirty_ = true;
+  }
+  return freeClusterCount_;
+}
+//------------------------------------------------------------------------------
 // free a cluster chain
 uint8_t SdVolume::freeChain(uint32_t cluster) {
-  // clear free cluster location
-  allocSearchStart_ = 2;
+  // run of adjacent clusters freed so far
+  uint32_t runStart = cluster;
+  uint32_t runCount = 0;
 
   do {
     uint32_t next;
@@ -202,13 +323,94 @@ uint8_t SdVolume::freeChain(uint32_t cluster) {
 
     // free cluster
     if (!fatPut(cluster, 0)) return false;
+    freeCountAdd(1);
+
+    // save run for reuse if this cluster does not extend it
+    if (cluster != runStart + runCount) {
+      freeExtentAdd(runStart, runCount);
+      runStart = cluster;
+      runCount = 0;
+    }
+    runCount++;
 
     cluster = next;
   } while (!isEOC(cluster));
 
+  freeExtentAdd(runStart, runCount);
   return true;
 }
 //------------------------------------------------------------------------------
+// remember a run of free clusters for a later allocation
+void SdVolume::freeExtentAdd(uint32_t start, uint32_t count) {
+  if (count == 0) return;
+
+  // slot to replace if the run can't be merged
+  uint8_t slot = 0;
+  for (uint8_t i = 0; i < SD_FREE_EXTENT_COUNT; i++) {
+    extent_t* e = &freeExtent_[i];
+    if (e->count) {
+      // merge with an adjacent run
+      if ((e->start + e->count) == start) {
+        e->count += count;
+        return;
+      }
+      if ((start + count) == e->start) {
+        e->start = start;
+        e->count += count;
+        return;
+      }
+    }
+    if (e->count < freeExtent_[slot].count) slot = i;
+  }
+  // replace an unused slot or the smallest run
+  if (count > freeExtent_[slot].count) {
+    freeExtent_[slot].start = start;
+    freeExtent_[slot].count = count;
+  }
+}
+//------------------------------------------------------------------------------
+// take count clusters from a remembered free run
+uint8_t SdVolume::freeExtentTake(uint32_t count, uint32_t* bgnCluster) {
+  for (uint8_t i = 0; i < SD_FREE_EXTENT_COUNT; i++) {
+    extent_t* e = &freeExtent_[i];
+    if (e->count < count) continue;
+
+    // run is only a hint - drop it if the clusters are no longer free
+    if (!freeRange(e->start, count)) {
+      e->count = 0;
+      continue;
+    }
+    *bgnCluster = e->start;
+    e->start += count;
+    e->count -= count;
+    return true;
+  }
+  return false;
+}
+//------------------------------------------------------------------------------
+// return true if count clusters starting at bgnCluster are free
+uint8_t SdVolume::freeRange(uint32_t bgnCluster, uint32_t count) {
+  if (bgnCluster < 2 || (bgnCluster + count - 1) > (clusterCount_ + 1)) {
+    return false;
+  }
+  for (uint32_t c = bgnCluster; c < (bgnCluster + count); c++) {
+    uint32_t f;
+    if (!fatGet(c, &f) || f != 0) return false;
+  }
+  return true;
+}
+//------------------------------------------------------------------------------
+// write free count and next free hint to the FAT32 FSINFO block
+uint8_t SdVolume::fsInfoSync(void) {
+  if (!fsInfoDirty_ || fsInfoBlock_ == 0) return true;
+  if (!cacheRawBlock(fsInfoBlock_, CACHE_FOR_WRITE)) return false;
+  fsinfo_t* fsi = &cacheBuffer_.fsinfo;
+  fsi->freeCount = freeClusterCount_;
+  fsi->nextFree = allocSearchStart_;
+  fsInfoDirty_ = 0;
+  return cacheFlush();
+}
+//------------------------------------------------------------------------------
 /**
  * Initialize a FAT volume.
  *
@@ -226,6 +428,10 @@ uint8_t SdVolume::freeChain(uint32_t cluster) {
  */
 uint8_t SdVolume::init(Sd2Card* dev, uint8_t part) {
   uint32_t volumeStartBlock = 0;
+
+  // FAT location of a volume this object left dirty in lazy mode
+  uint32_t dirtyFatStart = volumeDirty_ ? fatStartBlock_ : 0;
+
   sdCard_ = dev;
   // if part == 0 assume super floppy with FAT boot sector in block zero
   // if part > 0 assume mbr volume with partition table
@@ -291,5 +497,118 @@ uint8_t SdVolume::init(Sd2Card* dev, uint8_t part) {
     rootDirStart_ = bpb->fat32RootCluster;
     fatType_ = 32;
   }
+  // I/O counters classify blocks by this volume's layout
+  cacheVolume_ = this;
+
+  // remount of a volume with deferred updates - keep hints and updates
+  if (dirtyFatStart && dirtyFatStart == fatStartBlock_) return true;
+
+  // forget hints and deferred updates from a previous volume
+  volumeDirty_ = 0;
+  mirrorFirst_ = 0XFFFFFFFF;
+  mirrorLast_ = 0;
+  allocSearchStart_ = 2;
+  freeClusterCount_ = FSINFO_UNKNOWN;
+  fsInfoBlock_ = 0;
+  fsInfoDirty_ = 0;
+  for (uint8_t i = 0; i < SD_FREE_EXTENT_COUNT; i++) freeExtent_[i].count = 0;
+
+  // load free count and next free hints from FAT32 FSINFO
+  if (fatType_ == 32 && bpb->fat32FSInfo) {
+    uint32_t block = volumeStartBlock + bpb->fat32FSInfo;
+    if (!cacheRawBlock(block, CACHE_FOR_READ)) return false;
+    fsinfo_t* fsi = &cacheBuffer_.fsinfo;
+    if (fsi->leadSignature == FSINFO_LEAD_SIG &&
+      fsi->structSignature == FSINFO_STRUCT_SIG &&
+      fsi->tailSignature == FSINFO_TRAIL_SIG) {
+      fsInfoBlock_ = block;
+      if (fsi->freeCount <= clusterCount_) {
+        freeClusterCount_ = fsi->freeCount;
+      }
+      if (fsi->nextFree >= 2 && fsi->nextFree <= (clusterCount_ + 1)) {
+        allocSearchStart_ = fsi->nextFree;
+      }
+    }
+  }
+  // check clean shutdown bit in FAT entry one
+  unclean_ = 0;
+  if (fatType_ != 12) {
+    uint32_t f;
+    if (!fatGet(1, &f)) return false;
+    unclean_ = !(f & (fatType_ == 16 ? FAT16_CLEAN_SHUTDOWN
+                                     : FAT32_CLEAN_SHUTDOWN));
+  }
+  return true;
+}
+//------------------------------------------------------------------------------
+// I/O counter class for a block of the mounted volume
+uint8_t SdVolume::ioClass(uint32_t block) {
+  SdVolume* vol = cacheVolume_;
+  if (!vol || block >= vol->dataStartBlock_) return SD_IO_DATA;
+  uint32_t fatEnd = vol->fatStartBlock_ + vol->blocksPerFat_;
+  if (block < fatEnd) return SD_IO_FAT;
+  if (block < fatEnd + (vol->fatCount_ - 1) * vol->blocksPerFat_) {
+    return SD_IO_MIRROR;
+  }
+  // FAT16 root directory
+  return SD_IO_DIR;
+}
+//------------------------------------------------------------------------------
+// read a block continuing the current multiple block read if possible
+uint8_t SdVolume::readStream(uint32_t block, uint8_t* dst) {
+  if (!sdCard_->readContinues(block)) {
+    if (!sdCard_->readStart(block)) return false;
+  }
+  if (!sdCard_->readData(dst)) return false;
+  sdStats.blocksRead[ioClass(block)]++;
   return true;
 }
+//------------------------------------------------------------------------------
+/**
+ * Repair a volume after an unclean shutdown in lazy metadata mode.
+ *
+ * Mirror FAT blocks that differ from the primary FAT are rewritten, the
+ * free cluster count is recomputed and the volume is marked clean.  File
+ * sizes are repaired with SdFile::repairSize().
+ *
+ * \return The value one, true, is returned for success and
+ * the value zero, false, is returned for failure.
+ */
+uint8_t SdVolume::repair(void) {
+  // restored after the mirror FAT is checked
+  uint8_t partial = sdCard_->partialBlockRead();
+
+  if (fatCount_ > 1) {
+    sdCard_->partialBlockRead(true);
+    for (uint32_t lba = fatStartBlock_;
+      lba < (fatStartBlock_ + blocksPerFat_); lba++) {
+      if (!cacheRawBlock(lba, CACHE_FOR_READ)) goto fail;
+
+      // compare mirror block with primary block in cache
+      uint8_t match = true;
+      for (uint16_t i = 0; match && i < 512; i += 32) {
+        uint8_t buf[32];
+        if (!readData(lba + blocksPerFat_, i, 32, buf)) goto fail;
+        match = memcmp(buf, cacheBuffer_.data + i, 32) == 0;
+      }
+      if (!match) {
+        if (!writeBlock(lba + blocksPerFat_, cacheBuffer_.data)) goto fail;
+      }
+    }
+    sdCard_->partialBlockRead(partial);
+  }
+  mirrorFirst_ = 0XFFFFFFFF;
+  mirrorLast_ = 0;
+
+  // FSINFO is not written in lazy mode
+  freeClusterCount_ = FSINFO_UNKNOWN;
+  if (freeClusterCount() == FSINFO_UNKNOWN) return false;
+
+  unclean_ = 0;
+  volumeDirty_ = true;
+  return commit();
+
+ fail:
+  sdCard_->partialBlockRead(partial);
+  return false;
+}
@@ -30,6 +30,10 @@
 #include <avr/interrupt.h>
 #include "LowPower.h"
 
+// set by the watchdog interrupt, tells a watchdog wake from any other
+static volatile uint8_t wdtFired;
+static volatile uint32_t wdtCount;
+
 // Only Pico Power devices can change BOD settings through software
 #if defined __AVR_ATmega328P__
 #ifndef sleep_bod_disable
@@ -840,6 +844,184 @@ void	LowPowerClass::powerExtStandby(period_t period, adc_t adc, bod_t bod,
 	#endif
 }
 
+/*******************************************************************************
+* Name: periodMs
+* Description: Length of a watchdog period in milliseconds, corrected by the
+*			   last calibration. The watchdog runs from a 128 kHz oscillator
+*			   that can be 10-20 % off, so the names in period_t are only
+*			   nominal.
+*
+* Argument  	Description
+* =========  	===========
+* 1. period   SLEEP_15Ms to SLEEP_8S
+*
+*******************************************************************************/
+uint32_t	LowPowerClass::periodMs(period_t period)
+{
+	// 2K watchdog cycles at 128 kHz is 16 ms, each step doubles it
+	return ((uint32_t)16 << period) * scale / 1024;
+}
+
+/*******************************************************************************
+* Name: sleepFor
+* Description: Power down for an arbitrary time by chaining watchdog periods,
+*			   longest first. Any other interrupt ends the sleep early, and
+*			   the period it cut short is not counted. Times shorter than
+*			   the shortest period are not slept.
+*
+* Argument  	Description
+* =========  	===========
+* 1. ms       Milliseconds to sleep
+*
+* 2. adc		ADC module disable control, see powerDown
+*
+* 3. bod		Brown Out Detector (BOD) module disable control, see powerDown
+*
+* Returns the milliseconds slept, also kept for sleptMs.
+*******************************************************************************/
+uint32_t	LowPowerClass::sleepFor(uint32_t ms, adc_t adc, bod_t bod)
+{
+	slept = 0;
+	int8_t period = SLEEP_8S;
+	while (period >= SLEEP_15Ms)
+	{
+		uint32_t length = periodMs((period_t)period);
+		if (ms - slept < length)
+		{
+			period--;
+			continue;
+		}
+		wdtFired = 0;
+		powerDown((period_t)period, adc, bod);
+		if (!wdtFired)
+		{
+			break;
+		}
+		slept += length;
+	}
+	return slept;
+}
+
+/*******************************************************************************
+* Name: sleepUntil
+* Description: Power down until the clock set with setClock reads time. The
+*			   clock is read once, before sleeping.
+*
+* Argument  	Description
+* =========  	===========
+* 1. time     Clock time to wake at, in seconds
+*
+* 2. adc		ADC module disable control, see powerDown
+*
+* 3. bod		Brown Out Detector (BOD) module disable control, see powerDown
+*
+* Returns the milliseconds slept, also kept for sleptMs.
+*******************************************************************************/
+uint32_t	LowPowerClass::sleepUntil(uint32_t time, adc_t adc, bod_t bod)
+{
+	slept = 0;
+	if (!clock)
+	{
+		return 0;
+	}
+	uint32_t now = clock();
+	if (time <= now)
+	{
+		return 0;
+	}
+	return sleepFor((time - now) * 1000, adc, bod);
+}
+
+/*******************************************************************************
+* Name: setClock
+* Description: Set the clock used by sleepUntil and calibrate.
+*
+* Argument  	Description
+* =========  	===========
+* 1. clock    Function returning the time in seconds, such as an RTC read
+*
+*******************************************************************************/
+void	LowPowerClass::setClock(lowPowerClock_t clock)
+{
+	this->clock = clock;
+}
+
+// sleeps in 16 ms steps until the clock ticks, counting the steps
+static uint8_t waitForTick(LowPowerClass *lp, lowPowerClock_t clock, uint16_t *steps)
+{
+	uint32_t t = clock();
+	*steps = 0;
+	while (clock() == t)
+	{
+		wdtFired = 0;
+		lp->powerDown(SLEEP_15Ms, ADC_OFF, BOD_OFF);
+		if (!wdtFired || ++*steps > 200)
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*******************************************************************************
+* Name: calibrate
+* Description: Measure the watchdog against the clock set with setClock.
+*			   Finds a change of the seconds in 16 ms sleeps, sleeps two
+*			   8 s periods, then finds the next change the same way. Each
+*			   change is only seen to within a 16 ms step, so the result
+*			   is good to about 0.2 %. Takes about 17 s,
+*			   nearly all of it powered down. Any other interrupt aborts
+*			   it and the old calibration is kept.
+*
+* Returns 1 if the calibration was updated.
+*******************************************************************************/
+uint8_t	LowPowerClass::calibrate()
+{
+	uint16_t steps;
+	if (!clock || !waitForTick(this, clock, &steps))
+	{
+		return 0;
+	}
+	uint32_t start = clock();
+	for (uint8_t i = 0; i < 2; i++)
+	{
+		wdtFired = 0;
+		powerDown(SLEEP_8S, ADC_OFF, BOD_OFF);
+		if (!wdtFired)
+		{
+			return 0;
+		}
+	}
+	if (!waitForTick(this, clock, &steps))
+	{
+		return 0;
+	}
+	// whole seconds between the two ticks, over nominal ms slept between them
+	uint32_t real = (clock() - start) * 1000;
+	uint32_t nominal = 2 * 8192UL + steps * 16UL;
+	uint32_t newScale = real * 1024 / nominal;
+	if (newScale < 512 || newScale > 2048)
+	{
+		return 0;
+	}
+	scale = newScale;
+	return 1;
+}
+
+/*******************************************************************************
+* Name: wdtWakes
+* Description: Number of watchdog interrupts since reset, from any sleep.
+*
+*******************************************************************************/
+uint32_t	LowPowerClass::wdtWakes()
+{
+	uint8_t sreg = SREG;
+	cli();
+	uint32_t count = wdtCount;
+	SREG = sreg;
+	return count;
+}
+
 /*******************************************************************************
 * Name: ISR (WDT_vect)
 * Description: Watchdog Timer interrupt service routine. This routine is 
@@ -851,6 +1033,8 @@ ISR (WDT_vect)
 {
 	// WDIE & WDIF is cleared in hardware upon entering this ISR
 	wdt_disable();
+	wdtFired = 1;
+	wdtCount++;
 }
 
 LowPowerClass LowPower;
\ No newline at end of file
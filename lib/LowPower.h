@@ -1,6 +1,8 @@
 #ifndef LowPower_h
 #define LowPower_h
 
+#include <stdint.h>
+
 enum period_t
 {
 	SLEEP_15Ms,
@@ -16,6 +18,9 @@ enum period_t
 	SLEEP_FOREVER
 };
 
+// returns the time in seconds, used to calibrate the watchdog
+typedef uint32_t (*lowPowerClock_t)();
+
 enum bod_t
 {
 	BOD_OFF,
@@ -131,6 +136,21 @@ class LowPowerClass
 		void	powerSave(period_t period, adc_t adc, bod_t bod, timer2_t timer2);
 		void	powerStandby(period_t period, adc_t adc, bod_t bod);
 		void	powerExtStandby(period_t period, adc_t adc, bod_t bod, timer2_t timer2);
+
+		LowPowerClass() : clock(0), scale(1024), slept(0) {}
+		uint32_t	sleepFor(uint32_t ms, adc_t adc, bod_t bod);
+		uint32_t	sleepUntil(uint32_t time, adc_t adc, bod_t bod);
+		void	setClock(lowPowerClock_t clock);
+		uint8_t	calibrate();
+		uint32_t	periodMs(period_t period);
+		uint16_t	wdtScale() { return scale; }
+		uint32_t	sleptMs() { return slept; }
+		uint32_t	wdtWakes();
+
+	private:
+		lowPowerClock_t clock;
+		uint16_t	scale;		// real length of 1024 ms of watchdog time
+		uint32_t	slept;		// ms slept by the last sleepFor or sleepUntil
 };
 
 extern LowPowerClass LowPower;
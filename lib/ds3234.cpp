@@ -438,6 +438,35 @@ uint8_t DS3234_get_sram_8b(const uint8_t pin, const uint8_t address)
     return rv;
 }
 
+// the SRAM address register increments after each access to the data
+// register, and a burst on 19h/99h stays on the data register, so a block
+// takes one transaction to set the address and one to move the data
+void DS3234_set_sram(const uint8_t pin, const uint8_t address, const void *buf, const uint16_t len)
+{
+    const uint8_t *p = (const uint8_t *) buf;
+    uint16_t i;
+
+    DS3234_set_addr(pin, 0x98, address);
+    digitalWrite(pin, LOW);
+    SPI.transfer(0x99);
+    for (i = 0; i < len; i++)
+        SPI.transfer(p[i]);
+    digitalWrite(pin, HIGH);
+}
+
+void DS3234_get_sram(const uint8_t pin, const uint8_t address, void *buf, const uint16_t len)
+{
+    uint8_t *p = (uint8_t *) buf;
+    uint16_t i;
+
+    DS3234_set_addr(pin, 0x98, address);
+    digitalWrite(pin, LOW);
+    SPI.transfer(0x19);
+    for (i = 0; i < len; i++)
+        p[i] = SPI.transfer(0x00);
+    digitalWrite(pin, HIGH);
+}
+
 // helpers
 
 uint8_t dectobcd(const uint8_t val)
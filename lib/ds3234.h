@@ -67,6 +67,8 @@ uint8_t DS3234_triggered_a2(const uint8_t pin);
 // sram
 void DS3234_set_sram_8b(const uint8_t pin, const uint8_t address, const uint8_t value);
 uint8_t DS3234_get_sram_8b(const uint8_t pin, const uint8_t address);
+void DS3234_set_sram(const uint8_t pin, const uint8_t address, const void *buf, const uint16_t len);
+void DS3234_get_sram(const uint8_t pin, const uint8_t address, void *buf, const uint16_t len);
 
 // helpers
 uint8_t dectobcd(const uint8_t val);
@@ -0,0 +1,127 @@
+#include <string.h>
+#include "Compact.h"
+
+uint32_t compactRecord(uint32_t bucket, uint32_t gallons, uint8_t countBits)
+{
+	uint32_t mask = (1UL << countBits) - 1;
+	if (gallons > mask)
+	{
+		gallons = mask;
+	}
+	return (bucket << countBits) | gallons;
+}
+
+uint8_t compactInit(compactLevel *level, logRegion *src, uint32_t srcSeconds, uint8_t srcBits,
+	logRegion *dst, uint32_t dstSeconds, uint8_t dstBits, uint32_t keep)
+{
+	memset(level, 0, sizeof(compactLevel));
+	logIterSD(&level->src, src, srcSeconds, srcBits);
+	level->dst = dst;
+	level->dstSeconds = dstSeconds;
+	level->dstBits = dstBits;
+	level->keep = keep;
+
+	// start after the newest folded bucket, so nothing is folded twice after a reset
+	uint32_t seq = dst->seq;
+	if (dst->count == 0)
+	{
+		if (seq == 0)
+		{
+			return 1;						// nothing folded yet
+		}
+		seq--;
+	}
+	logBlock *blk = (logBlock *)SdVolume::cacheClear();
+	if (!logBlockRead(dst, seq, blk) || blk->hdr.count == 0)
+	{
+		return 0;
+	}
+	uint32_t done = blk->rec[blk->hdr.count - 1] >> dstBits;
+	logIterSeek(&level->src, (done + 1) * dstSeconds);
+	return 1;
+}
+
+// the ring writer overwrites source block seq within the next few blocks
+static uint8_t wrapsWithin(const compactLevel *level, uint32_t seq, uint8_t blocks)
+{
+	const logRegion *log = level->src.log;
+	return seq + log->blockCount < logBlockNextSeq(log) + blocks;
+}
+
+// the batch holds the only copy once its source is overwritten
+static uint8_t batchDue(const compactLevel *level)
+{
+	return level->batchCount == COMPACT_BATCH
+		|| (level->batchCount && wrapsWithin(level, level->batchSeq, COMPACT_WRAP_BLOCKS / 2));
+}
+
+static uint8_t writeBatch(compactLevel *level)
+{
+	if (!logBlockAppendRecords(level->dst, level->batch, level->batchCount))
+	{
+		return 0;
+	}
+	level->batchCount = 0;
+	return 1;
+}
+
+uint8_t compactPending(const compactLevel *level, uint32_t now)
+{
+	if (!level->dst || !level->dst->card)
+	{
+		return 0;
+	}
+	if (batchDue(level))
+	{
+		return 1;
+	}
+	if (now < level->waitUntil && !wrapsWithin(level, level->src.pos, COMPACT_WRAP_BLOCKS))
+	{
+		return 0;
+	}
+	return logIterPending(&level->src);
+}
+
+uint8_t compactStep(compactLevel *level, uint32_t now)
+{
+	logRecord rec;
+	uint8_t read = 0;
+	if (batchDue(level))
+	{
+		return writeBatch(level);
+	}
+	while (!(read && logIterBlockDone(&level->src)) && logIterPeek(&level->src, &rec))
+	{
+		read = 1;
+		if (rec.time + level->keep > now && !wrapsWithin(level, level->src.pos, COMPACT_WRAP_BLOCKS))
+		{
+			level->waitUntil = rec.time + level->keep;
+			return 1;						// records are in time order, the rest are newer
+		}
+		uint32_t b = rec.time / level->dstSeconds;
+		if (level->started && b > level->bucket)
+		{
+			// the bucket is complete
+			level->batch[level->batchCount++] = compactRecord(level->bucket, level->gallons, level->dstBits);
+			level->started = 0;
+			if (batchDue(level))
+			{
+				// the append reuses the cache, so stop here
+				return writeBatch(level);
+			}
+		}
+		if (!level->started)
+		{
+			if (level->batchCount == 0)
+			{
+				level->batchSeq = level->src.pos;
+			}
+			level->started = 1;
+			level->bucket = b;
+			level->gallons = 0;
+		}
+		level->gallons += rec.gallons;
+		logIterNext(&level->src, &rec);
+	}
+	return read;
+}
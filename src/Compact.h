@@ -0,0 +1,61 @@
+#ifndef __Compact_h_
+#define __Compact_h_
+
+#include <stdint.h>
+#include "LogIter.h"
+
+/*
+  Retention for the SD logs.
+
+  Raw gallon timestamps are kept for a number of days, then folded into
+  hourly totals in a second log, and those are later folded into daily
+  totals in a third.  Each log is a fixed ring (see LogBlock.h), so space
+  is reclaimed by letting the writer overwrite blocks that have been
+  folded and the files and their FAT chains never change.
+
+  A folded record is the bucket number shifted up by countBits with the
+  gallons in the low bits.  With 12 bits for hours and 16 for days the
+  bucket numbers last past 2100.
+
+  compactStep does a bounded amount of work: it reads at most one source
+  block (see LogIter.h).  Folded records collect in a batch in RAM and
+  go to the destination COMPACT_BATCH at a time, so a destination block
+  is written about LOG_BLOCK_RECORDS / COMPACT_BATCH times instead of
+  once per record.  The cursor and the batch live in RAM.  After a reset
+  they are found again by seeking the source to the bucket after the
+  newest destination record.
+
+  A source record is folded when it is keep seconds old, or sooner when
+  the writer is within COMPACT_WRAP_BLOCKS of overwriting its block, so
+  a busy meter gets shorter raw retention instead of gaps.  The batch is
+  written early when the source of its oldest record is within half that
+  of being overwritten, so a reset never loses more than the bucket being
+  summed.  Blocks that were overwritten anyway are counted in src.lost.
+*/
+
+#define COMPACT_BATCH		8			// folded records held before a destination write
+#define COMPACT_WRAP_BLOCKS	4			// fold regardless of age this close to the writer
+
+struct compactLevel
+{
+	logIter src;			// next source record
+	logRegion *dst;
+	uint32_t dstSeconds;	// bucket size of the folded records
+	uint32_t keep;			// seconds a source record is kept before it is folded
+	uint8_t dstBits;		// count bits of folded records
+	uint8_t started;		// bucket holds a partial sum
+	uint32_t bucket;		// bucket being summed
+	uint32_t gallons;		// gallons in it so far
+	uint32_t waitUntil;		// the next record is not old enough before this time
+	uint32_t batch[COMPACT_BATCH];	// folded records not yet written
+	uint8_t batchCount;
+	uint32_t batchSeq;		// source block of the oldest batched record
+};
+
+uint8_t compactInit(compactLevel *level, logRegion *src, uint32_t srcSeconds, uint8_t srcBits,
+	logRegion *dst, uint32_t dstSeconds, uint8_t dstBits, uint32_t keep);
+uint8_t compactPending(const compactLevel *level, uint32_t now);
+uint8_t compactStep(compactLevel *level, uint32_t now);
+uint32_t compactRecord(uint32_t bucket, uint32_t gallons, uint8_t countBits);
+
+#endif
@@ -0,0 +1,51 @@
+#include <Arduino.h>
+#include <stddef.h>
+#include <string.h>
+#include <util/crc16.h>
+#include "ds3234.h"
+#include "EnergyStats.h"
+
+energyStats stats;
+
+static uint16_t carry[STATS_TIMES];			// microseconds not yet a whole millisecond
+
+static uint16_t statsCRC(const energyStats *s)
+{
+	uint16_t crc = 0xFFFF;
+	const uint8_t *p = (const uint8_t *)s;
+	for (uint8_t i = 0; i < offsetof(energyStats, crc); i++)
+	{
+		crc = _crc16_update(crc, p[i]);
+	}
+	return crc;
+}
+
+// counts a reset, returns 0 if the saved counters were lost
+uint8_t statsLoad(const uint8_t pin)
+{
+	uint8_t ok = 1;
+	DS3234_get_sram(pin, STATS_ADDR, &stats, sizeof(stats));
+	if (stats.magic != STATS_MAGIC || stats.crc != statsCRC(&stats))
+	{
+		memset(&stats, 0, sizeof(stats));
+		ok = 0;
+	}
+	stats.resets++;
+	statsSave(pin);
+	return ok;
+}
+
+void statsSave(const uint8_t pin)
+{
+	stats.magic = STATS_MAGIC;
+	stats.crc = statsCRC(&stats);
+	DS3234_set_sram(pin, STATS_ADDR, &stats, sizeof(stats));
+}
+
+// adds the time since startMicros, a micros() reading
+void statsAddTime(statsTime path, uint32_t startMicros)
+{
+	uint32_t us = micros() - startMicros + carry[path];
+	stats.ms[path] += us / 1000;
+	carry[path] = us % 1000;
+}
@@ -0,0 +1,51 @@
+#ifndef __EnergyStats_h_
+#define __EnergyStats_h_
+
+#include <stdint.h>
+
+/*
+  Where the battery goes: wakes by reason, awake time by code path, radio
+  and SD card time, and EEPROM bytes written.
+
+  The counters live in RAM and an event costs one increment, or a
+  micros() read and an add for a timed path.  statsSave writes them to
+  the DS3234 SRAM as one burst with a CRC16, so they add up across
+  resets.  A bad copy starts them again from zero.  Everything counts
+  up and wraps, so whoever collects them takes differences.
+
+  Timed paths can nest, a gallon that fills a staged block counts in
+  both TIME_PULSE and TIME_STORAGE.  micros() stops in power down, so
+  the times are awake time only.
+
+  SRAM map: 0x28-0x5B, see HotCounters.h.  statsLoad and statsSave need
+  the SPI bus set up for the RTC.
+*/
+
+#define STATS_ADDR			0x28
+#define STATS_MAGIC			0x46		// 0x45 was at 0x20
+
+enum wakeReason {WAKE_WDT, WAKE_METER, WAKE_RADIO, WAKE_ALARM, WAKE_OTHER, WAKE_REASONS};
+enum statsTime {TIME_PULSE, TIME_REPORT, TIME_VALVE, TIME_STORAGE, TIME_RADIO, TIME_SD, STATS_TIMES};
+
+struct energyStats
+{
+	uint8_t magic;			// STATS_MAGIC
+	uint8_t resets;
+	uint32_t wakes[WAKE_REASONS];
+	uint32_t ms[STATS_TIMES];
+	uint32_t eepromWrites;
+	uint16_t crc;			// CRC16 of the fields above
+};
+
+extern energyStats stats;
+
+static inline void statsWake(wakeReason reason)
+{
+	stats.wakes[reason]++;
+}
+
+uint8_t statsLoad(const uint8_t pin);
+void statsSave(const uint8_t pin);
+void statsAddTime(statsTime path, uint32_t startMicros);
+
+#endif
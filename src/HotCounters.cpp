@@ -0,0 +1,81 @@
+#include <stddef.h>
+#include <string.h>
+#include <util/crc16.h>
+#include "ds3234.h"
+#include "HotCounters.h"
+
+hotCounters hot;
+
+static uint16_t hotCRC(const hotCounters *c)
+{
+	uint16_t crc = 0xFFFF;
+	const uint8_t *p = (const uint8_t *)c;
+	for (uint8_t i = 0; i < offsetof(hotCounters, crc); i++)
+	{
+		crc = _crc16_update(crc, p[i]);
+	}
+	return crc;
+}
+
+static uint8_t hotValid(const hotCounters *c)
+{
+	return c->magic == HOT_MAGIC && c->logCount <= HOT_LOG_RECORDS && c->crc == hotCRC(c);
+}
+
+// returns 0 and zeroed counters if neither copy is good
+uint8_t hotLoad(const uint8_t pin)
+{
+	hotCounters copy[2];
+	DS3234_get_sram(pin, HOT_COPY_ADDR, &copy[0], sizeof(hotCounters));
+	DS3234_get_sram(pin, HOT_COPY_ADDR + HOT_COPY_SIZE, &copy[1], sizeof(hotCounters));
+	uint8_t good0 = hotValid(&copy[0]);
+	uint8_t good1 = hotValid(&copy[1]);
+	if (good0 && (!good1 || (int8_t)(copy[0].seq - copy[1].seq) > 0))
+	{
+		hot = copy[0];
+	}
+	else if (good1)
+	{
+		hot = copy[1];
+	}
+	else
+	{
+		memset(&hot, 0, sizeof(hot));
+		return 0;
+	}
+	return 1;
+}
+
+void hotSave(const uint8_t pin)
+{
+	hot.magic = HOT_MAGIC;
+	hot.seq++;
+	hot.crc = hotCRC(&hot);
+	DS3234_set_sram(pin, HOT_COPY_ADDR + (hot.seq & 1) * HOT_COPY_SIZE, &hot, sizeof(hot));
+}
+
+// returns 0 if the pending log is full
+uint8_t hotAddRecord(const uint8_t pin, uint32_t t_unix)
+{
+	if (hot.logCount >= HOT_LOG_RECORDS)
+	{
+		return 0;
+	}
+	DS3234_set_sram(pin, HOT_LOG_ADDR + hot.logCount * sizeof(uint32_t), &t_unix, sizeof(t_unix));
+	hot.logCount++;
+	hotSave(pin);
+	return 1;
+}
+
+uint32_t hotRecord(const uint8_t pin, uint8_t i)
+{
+	uint32_t t_unix;
+	DS3234_get_sram(pin, HOT_LOG_ADDR + i * sizeof(uint32_t), &t_unix, sizeof(t_unix));
+	return t_unix;
+}
+
+void hotClearRecords(const uint8_t pin)
+{
+	hot.logCount = 0;
+	hotSave(pin);
+}
@@ -0,0 +1,52 @@
+#ifndef __HotCounters_h_
+#define __HotCounters_h_
+
+#include <stdint.h>
+
+/*
+  Counters that change with every gallon, kept in the DS3234 SRAM.
+
+  The RTC battery keeps the SRAM through power cuts and it has no write
+  limit, so EEPROM only holds settings that rarely change and closed
+  rollup buckets (see Rollup.h).  The counters are written as one burst
+  to alternate copies, each with a sequence
+  byte and a CRC16, and hotLoad takes the newest good copy, so a reset
+  part way through a write loses only the last update.
+
+  The gallon log waiting to be reported by radio is kept next to them.
+  A record is written before the count that includes it.
+
+  SRAM map: 0x00-0x27 counters, 0x28-0x5B see EnergyStats.h, 0x5C-0x8F
+  pending log, 0x90-0xFF see LogStage.h.  All functions need the SPI bus
+  set up for the RTC.
+*/
+
+#define HOT_COPY_ADDR		0x00
+#define HOT_COPY_SIZE		20
+#define HOT_LOG_ADDR		0x5C
+#define HOT_LOG_RECORDS		13
+#define HOT_MAGIC			0x4B		// 0x4A had no open hour, 0x49 no last gallon time, 0x48 the pending log at 0x40
+
+struct hotCounters
+{
+	uint8_t magic;			// HOT_MAGIC
+	uint8_t seq;			// the newer copy has the higher sequence, mod 256
+	uint8_t logCount;		// records in the pending log
+	uint8_t consecGallons;	// gallons within a minute of the one before
+	uint16_t dayGallons;
+	uint32_t dayStart;		// time of the first gallon of the day
+	uint32_t lastGallon;	// time of the newest gallon, for the rollups
+	uint16_t hourGallons;	// gallons in the open rollup hour, the one lastGallon is in
+	uint16_t hourPeak;		// shortest seconds between two gallons in it
+	uint16_t crc;			// CRC16 of the fields above
+};
+
+extern hotCounters hot;
+
+uint8_t hotLoad(const uint8_t pin);
+void hotSave(const uint8_t pin);
+uint8_t hotAddRecord(const uint8_t pin, uint32_t t_unix);
+uint32_t hotRecord(const uint8_t pin, uint8_t i);
+void hotClearRecords(const uint8_t pin);
+
+#endif
@@ -0,0 +1,294 @@
+#include <string.h>
+#include "LogBlock.h"
+#ifdef __AVR__
+#include <util/crc16.h>
+#else
+// same as avr-libc _crc16_update, for tools/log_block_test.cpp
+static inline uint16_t _crc16_update(uint16_t crc, uint8_t a)
+{
+	crc ^= a;
+	for (uint8_t i = 0; i < 8; i++)
+	{
+		crc = crc & 1 ? (crc >> 1) ^ 0xA001 : crc >> 1;
+	}
+	return crc;
+}
+#endif
+
+static uint32_t logSlot(const logRegion *log, uint32_t seq)
+{
+	return log->firstBlock + seq % log->blockCount;
+}
+
+// raw card writes are counted here, the volume only counts its own
+static uint8_t writeSlot(logRegion *log, uint32_t seq, const logBlock *blk)
+{
+	log->writes++;
+	if (!log->card->writeBlock(logSlot(log, seq), (const uint8_t *)blk))
+	{
+		return 0;
+	}
+	sdStats.blocksWritten[SD_IO_DATA]++;
+	return 1;
+}
+
+// reads only the header of the block in a slot
+static uint8_t readHeader(const logRegion *log, uint32_t slot, logBlockHeader *hdr)
+{
+	return log->card->readData(log->firstBlock + slot, 0, sizeof(logBlockHeader), (uint8_t *)hdr);
+}
+
+// true if the slot holds the block written slot blocks after seq0
+static uint8_t inLap(const logRegion *log, uint32_t slot, uint32_t seq0)
+{
+	logBlockHeader hdr;
+	if (!readHeader(log, slot, &hdr))
+	{
+		return 0;
+	}
+	return hdr.magic == LOG_BLOCK_MAGIC && hdr.seq == seq0 + slot;
+}
+
+uint16_t logBlockCRC(const logBlock *blk)
+{
+	uint16_t crc = 0xFFFF;
+	uint16_t count = blk->hdr.count;
+	if (count > LOG_BLOCK_RECORDS)
+	{
+		count = LOG_BLOCK_RECORDS;
+	}
+	const uint8_t *p = (const uint8_t *)&blk->hdr.seq;
+	const uint8_t *end = (const uint8_t *)&blk->hdr.crc;
+	while (p != end)
+	{
+		crc = _crc16_update(crc, *p++);
+	}
+	p = (const uint8_t *)blk->rec;
+	end = (const uint8_t *)&blk->rec[count];
+	while (p != end)
+	{
+		crc = _crc16_update(crc, *p++);
+	}
+	return crc;
+}
+
+uint8_t logBlockValid(const logBlock *blk)
+{
+	return blk->hdr.magic == LOG_BLOCK_MAGIC && blk->hdr.count <= LOG_BLOCK_RECORDS
+		&& blk->hdr.crc == logBlockCRC(blk);
+}
+
+uint8_t logBlockRecover(logRegion *log, Sd2Card *card, uint32_t firstBlock, uint32_t blockCount)
+{
+	logBlockHeader hdr;
+	log->card = card;
+	log->firstBlock = firstBlock;
+	log->blockCount = blockCount;
+	log->seq = 0;
+	log->count = 0;
+	log->writes = 0;
+	if (blockCount == 0 || !readHeader(log, 0, &hdr))
+	{
+		return 0;
+	}
+
+	uint32_t tail;
+	if (hdr.magic == LOG_BLOCK_MAGIC && hdr.seq % blockCount == 0)
+	{
+		// slots 0..tail hold the lap that starts with slot 0, later slots
+		// are from the previous lap or were never written
+		uint32_t seq0 = hdr.seq;
+		uint32_t lo = 0;
+		uint32_t hi = blockCount - 1;
+		while (lo < hi)
+		{
+			uint32_t mid = lo + (hi - lo + 1) / 2;
+			if (inLap(log, mid, seq0))
+			{
+				lo = mid;
+			}
+			else
+			{
+				hi = mid - 1;
+			}
+		}
+		tail = lo;
+		log->seq = seq0 + tail;
+	}
+	else
+	{
+		// slot 0 is empty or was torn starting a new lap - the newest
+		// complete block is the last slot if the log has wrapped
+		tail = blockCount - 1;
+		if (!readHeader(log, tail, &hdr))
+		{
+			return 0;
+		}
+		if (hdr.magic != LOG_BLOCK_MAGIC || hdr.seq % blockCount != tail)
+		{
+			return 1;					// empty log
+		}
+		log->seq = hdr.seq + 1;			// rewrite slot 0
+		return 1;
+	}
+
+	// check the newest block - a torn block is started again
+	logBlock *blk = (logBlock *)SdVolume::cacheClear();
+	if (!card->readBlock(logSlot(log, log->seq), (uint8_t *)blk))
+	{
+		return 0;
+	}
+	if (logBlockValid(blk) && blk->hdr.seq == log->seq)
+	{
+		log->count = blk->hdr.count;
+	}
+	return 1;
+}
+
+uint8_t logBlockAppend(logRegion *log, uint32_t record)
+{
+	return logBlockAppendRecords(log, &record, 1);
+}
+
+// each block the records go into is written once
+uint8_t logBlockAppendRecords(logRegion *log, const uint32_t *rec, uint8_t n)
+{
+	while (n)
+	{
+		// the volume cache is the block buffer
+		logBlock *blk = (logBlock *)SdVolume::cacheClear();
+		if (log->count >= LOG_BLOCK_RECORDS)
+		{
+			log->seq++;
+			log->count = 0;
+		}
+		if (log->count == 0)
+		{
+			memset(blk, 0, sizeof(logBlock));
+		}
+		else if (!log->card->readBlock(logSlot(log, log->seq), (uint8_t *)blk))
+		{
+			return 0;
+		}
+		uint8_t k = LOG_BLOCK_RECORDS - log->count < n ? LOG_BLOCK_RECORDS - log->count : n;
+		memcpy(&blk->rec[log->count], rec, k * sizeof(uint32_t));
+		blk->hdr.magic = LOG_BLOCK_MAGIC;
+		blk->hdr.seq = log->seq;
+		blk->hdr.count = log->count + k;
+		blk->hdr.crc = logBlockCRC(blk);
+		if (!writeSlot(log, log->seq, blk))
+		{
+			return 0;
+		}
+		log->count += k;
+		rec += k;
+		n -= k;
+	}
+	return 1;
+}
+
+// the staged block as a changed cache block, read back if the cache was reused
+static logBlock *stagedBlock(logRegion *log)
+{
+	logBlock *blk = (logBlock *)SdVolume::cacheWrite(log->card, logSlot(log, log->seq));
+	if (!blk)
+	{
+		return 0;
+	}
+	if (log->count == 0)
+	{
+		memset(blk, 0, sizeof(logBlock));
+	}
+	else if (!logBlockValid(blk) || blk->hdr.seq != log->seq || blk->hdr.count != log->count)
+	{
+		// not written before the cache was reused - start the block again
+		memset(blk, 0, sizeof(logBlock));
+		log->count = 0;
+	}
+	return blk;
+}
+
+uint8_t logBlockStage(logRegion *log, uint32_t record)
+{
+	if (log->count >= LOG_BLOCK_RECORDS)
+	{
+		log->seq++;
+		log->count = 0;
+	}
+	logBlock *blk = stagedBlock(log);
+	if (!blk)
+	{
+		return 0;
+	}
+	// a valid block whenever another cache user writes it
+	blk->hdr.magic = LOG_BLOCK_MAGIC;
+	blk->hdr.seq = log->seq;
+	blk->rec[log->count++] = record;
+	blk->hdr.count = log->count;
+	blk->hdr.crc = logBlockCRC(blk);
+	if (log->count < LOG_BLOCK_RECORDS)
+	{
+		return 1;
+	}
+	return logBlockFlush(log);
+}
+
+uint8_t logBlockFlush(logRegion *log)
+{
+	if (log->count == 0)
+	{
+		return 1;
+	}
+	if (!stagedBlock(log) || log->count == 0)
+	{
+		return 0;
+	}
+	log->writes++;
+	return SdVolume::cacheSync();
+}
+
+uint8_t logBlockWrite(logRegion *log, logBlock *blk)
+{
+	if (blk->hdr.count == 0 || blk->hdr.count > LOG_BLOCK_RECORDS)
+	{
+		return 0;
+	}
+	uint32_t seq = logBlockNextSeq(log);
+	blk->hdr.magic = LOG_BLOCK_MAGIC;
+	blk->hdr.seq = seq;
+	blk->hdr.crc = logBlockCRC(blk);
+	if (!writeSlot(log, seq, blk))
+	{
+		return 0;
+	}
+	// the block is never written again, even if it has room
+	log->seq = seq;
+	log->count = blk->hdr.count;
+	return 1;
+}
+
+// sequence number of the next block that starts empty
+uint32_t logBlockNextSeq(const logRegion *log)
+{
+	return log->count ? log->seq + 1 : log->seq;
+}
+
+// oldest block still in the ring
+uint32_t logBlockOldestSeq(const logRegion *log)
+{
+	return log->seq >= log->blockCount ? log->seq - log->blockCount + 1 : 0;
+}
+
+uint8_t logBlockRead(logRegion *log, uint32_t seq, logBlock *blk)
+{
+	// only the last blockCount blocks are kept
+	if (seq > log->seq || log->seq - seq >= log->blockCount)
+	{
+		return 0;
+	}
+	if (!log->card->readBlock(logSlot(log, seq), (uint8_t *)blk))
+	{
+		return 0;
+	}
+	return logBlockValid(blk) && blk->hdr.seq == seq;
+}
@@ -0,0 +1,75 @@
+#ifndef __LogBlock_h_
+#define __LogBlock_h_
+
+#include <stdint.h>
+#include <SD.h>
+
+/*
+  Crash-consistent gallon log on the SD card.
+
+  The log is a fixed region of blocks, either a preallocated contiguous
+  file or a raw area of the card, used as a ring.  Each 512 byte block
+  holds a header and up to LOG_BLOCK_RECORDS timestamps.  The block with
+  sequence number seq is always stored in slot seq % blockCount, so the
+  newest block can be found at boot with a binary search over the
+  headers instead of reading the whole region.
+
+  The CRC covers the sequence number, count and records.  A block torn
+  by a power cut fails the CRC and only the records in that block are
+  lost.
+
+  logBlockAppend writes the block after every record, and
+  logBlockAppendRecords after every batch of records.  logBlockStage
+  keeps the newest block in the volume cache, marked changed, and writes
+  it once, when it is full.  Anything else that reuses the cache writes
+  the staged block first, and the next logBlockStage reads it back and
+  checks its sequence number and CRC before adding to it.  Records
+  staged since the last write are lost on a power cut unless
+  logBlockFlush is called.  logBlockWrite writes a block the caller
+  has filled as the next block, so each card block is written exactly
+  once (see LogStage.h).  writes counts the block writes so the cost per
+  block can be checked.
+*/
+
+#define LOG_BLOCK_MAGIC		0x4C4F4731UL			// "LOG1"
+
+struct logBlockHeader
+{
+	uint32_t magic;			// LOG_BLOCK_MAGIC
+	uint32_t seq;			// block sequence number, 0 for the first block
+	uint16_t count;			// records used
+	uint16_t crc;			// CRC16 of seq, count and the used records
+};
+
+#define LOG_BLOCK_RECORDS	((512 - sizeof(logBlockHeader)) / sizeof(uint32_t))
+
+struct logBlock
+{
+	logBlockHeader hdr;
+	uint32_t rec[LOG_BLOCK_RECORDS];
+};
+
+struct logRegion
+{
+	Sd2Card *card;
+	uint32_t firstBlock;	// first block of the region
+	uint32_t blockCount;	// blocks in the region
+	uint32_t seq;			// sequence number of the newest block
+	uint16_t count;			// records in the newest block
+	uint32_t writes;		// block writes since recovery
+};
+
+uint16_t logBlockCRC(const logBlock *blk);
+uint8_t logBlockValid(const logBlock *blk);
+
+uint8_t logBlockRecover(logRegion *log, Sd2Card *card, uint32_t firstBlock, uint32_t blockCount);
+uint8_t logBlockAppend(logRegion *log, uint32_t record);
+uint8_t logBlockAppendRecords(logRegion *log, const uint32_t *rec, uint8_t n);
+uint8_t logBlockStage(logRegion *log, uint32_t record);
+uint8_t logBlockFlush(logRegion *log);
+uint8_t logBlockWrite(logRegion *log, logBlock *blk);
+uint32_t logBlockNextSeq(const logRegion *log);
+uint32_t logBlockOldestSeq(const logRegion *log);
+uint8_t logBlockRead(logRegion *log, uint32_t seq, logBlock *blk);
+
+#endif
@@ -0,0 +1,231 @@
+#include <string.h>
+#include <EEPROM.h>
+#include "ds3234.h"
+#include "LogIter.h"
+
+#define CHECKED_NEWEST	1				// block checked while it was the newest one
+#define CHECKED_FULL	2				// block checked after the log moved past it
+
+static void decode(const logIter *it, uint32_t raw, logRecord *rec)
+{
+	if (it->seconds == 0)
+	{
+		rec->time = raw;
+		rec->gallons = 1;
+	}
+	else
+	{
+		rec->time = (raw >> it->bits) * it->seconds;
+		rec->gallons = raw & ((1UL << it->bits) - 1);
+	}
+}
+
+static void setBlock(logIter *it, uint32_t seq)
+{
+	it->pos = seq;
+	it->index = 0;
+	it->count = 0;
+	it->checked = 0;
+}
+
+// block pos in the volume cache, 0 if it was overwritten or torn
+static const logBlock *currentBlock(logIter *it, uint8_t *error)
+{
+	const logRegion *log = it->log;
+	const logBlock *blk = (const logBlock *)SdVolume::cacheRead(log->card, log->firstBlock + it->pos % log->blockCount);
+	*error = !blk;
+	if (!blk || blk->hdr.magic != LOG_BLOCK_MAGIC || blk->hdr.seq != it->pos)
+	{
+		return 0;
+	}
+	if (!it->checked)
+	{
+		if (!logBlockValid(blk))
+		{
+			return 0;
+		}
+		it->checked = it->pos < log->seq ? CHECKED_FULL : CHECKED_NEWEST;
+		it->count = blk->hdr.count;
+	}
+	return blk;
+}
+
+void logIterEEPROM(logIter *it, uint16_t first, uint16_t end)
+{
+	memset(it, 0, sizeof(logIter));
+	it->source = LOG_EEPROM;
+	it->pos = first;
+	it->count = end;
+}
+
+void logIterSRAM(logIter *it, const uint8_t pin, uint8_t first, uint16_t end)
+{
+	memset(it, 0, sizeof(logIter));
+	it->source = LOG_SRAM;
+	it->pin = pin;
+	it->pos = first;
+	it->count = end;
+}
+
+void logIterSD(logIter *it, logRegion *log, uint32_t seconds, uint8_t bits)
+{
+	memset(it, 0, sizeof(logIter));
+	it->source = LOG_SD;
+	it->log = log;
+	it->seconds = seconds;
+	it->bits = bits;
+	setBlock(it, logBlockOldestSeq(log));
+}
+
+uint8_t logIterPeek(logIter *it, logRecord *rec)
+{
+	if (it->source != LOG_SD)
+	{
+		if (it->pos + 4 > it->count)
+		{
+			return 0;
+		}
+		uint32_t raw = 0;
+		if (it->source == LOG_SRAM)
+		{
+			DS3234_get_sram(it->pin, it->pos, &raw, sizeof(raw));
+		}
+		else
+		{
+			for (uint8_t i = 0; i < 4; i++)
+			{
+				raw = (raw << 8) | EEPROM.read(it->pos + i);
+			}
+		}
+		decode(it, raw, rec);
+		return 1;
+	}
+
+	const logRegion *log = it->log;
+	uint8_t rechecked = 0;
+	for (;;)
+	{
+		if (it->pos < logBlockOldestSeq(log))
+		{
+			it->lost += logBlockOldestSeq(log) - it->pos;
+			setBlock(it, logBlockOldestSeq(log));	// overwritten before it was read
+		}
+		if (it->pos > log->seq || (it->pos == log->seq && it->index >= log->count))
+		{
+			return 0;								// caught up
+		}
+		if (it->checked == CHECKED_NEWEST && it->pos < log->seq)
+		{
+			it->checked = 0;						// more may have been added before it was finished
+		}
+		if (it->checked == CHECKED_FULL && it->index >= it->count)
+		{
+			setBlock(it, it->pos + 1);				// finished, no need to read it again
+			continue;
+		}
+		uint8_t error;
+		const logBlock *blk = currentBlock(it, &error);
+		if (error)
+		{
+			return 0;
+		}
+		if (blk && it->index < it->count)
+		{
+			decode(it, blk->rec[it->index], rec);
+			return 1;
+		}
+		if (it->pos == log->seq)
+		{
+			if (!blk || rechecked)
+			{
+				return 0;
+			}
+			it->checked = 0;						// records were appended since the check
+			rechecked = 1;
+			continue;
+		}
+		setBlock(it, it->pos + 1);					// torn
+	}
+}
+
+uint8_t logIterNext(logIter *it, logRecord *rec)
+{
+	if (!logIterPeek(it, rec))
+	{
+		return 0;
+	}
+	if (it->source == LOG_SD)
+	{
+		it->index++;
+	}
+	else
+	{
+		it->pos += 4;
+	}
+	return 1;
+}
+
+// moves to the first record at or after t_unix
+uint8_t logIterSeek(logIter *it, uint32_t t_unix)
+{
+	logRecord rec;
+	if (it->source == LOG_SD)
+	{
+		// the last block that starts before t_unix
+		const logRegion *log = it->log;
+		uint32_t lo = logBlockOldestSeq(log);
+		uint32_t hi = log->seq;
+		while (lo < hi)
+		{
+			uint32_t mid = lo + (hi - lo + 1) / 2;
+			setBlock(it, mid);
+			uint8_t error;
+			const logBlock *blk = currentBlock(it, &error);
+			if (error)
+			{
+				return 0;
+			}
+			if (blk && it->count)
+			{
+				decode(it, blk->rec[0], &rec);
+				if (rec.time < t_unix)
+				{
+					lo = mid;
+					continue;
+				}
+			}
+			hi = mid - 1;						// torn blocks are scanned past below
+		}
+		setBlock(it, lo);
+	}
+	while (logIterPeek(it, &rec))
+	{
+		if (rec.time >= t_unix)
+		{
+			return 1;
+		}
+		logIterNext(it, &rec);
+	}
+	return 0;
+}
+
+// true if records are left, without reading the card
+uint8_t logIterPending(const logIter *it)
+{
+	const logRegion *log = it->log;
+	if (it->source != LOG_SD)
+	{
+		return it->pos + 4 <= it->count;
+	}
+	if (!log->card)
+	{
+		return 0;
+	}
+	return it->pos < log->seq || (it->pos == log->seq && it->index < log->count);
+}
+
+// true once every record of the current SD block has been read
+uint8_t logIterBlockDone(const logIter *it)
+{
+	return it->source == LOG_SD && it->checked && it->index >= it->count;
+}
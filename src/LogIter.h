@@ -0,0 +1,54 @@
+#ifndef __LogIter_h_
+#define __LogIter_h_
+
+#include <stdint.h>
+#include "LogBlock.h"
+
+/*
+  Forward iterator over decoded log records.
+
+  The same scan works over the old EEPROM gallon log, where each record
+  is a big endian unix time, the pending log in the DS3234 SRAM (see
+  HotCounters.h), and over the SD logs (see LogBlock.h), which
+  hold gallon timestamps or folded totals (see Compact.h).  Records are
+  decoded straight out of the volume cache: each block is read once and
+  its CRC checked once, later records in the block are cache hits.
+
+  A block overwritten by the ring while it is being read is noticed by
+  its sequence number and the iterator moves on to the oldest block,
+  adding the blocks it skipped to lost.
+  Records appended to the newest block show up on the next peek.
+*/
+
+struct logRecord
+{
+	uint32_t time;			// unix time of the gallon, or the start of a folded bucket
+	uint32_t gallons;		// 1 for a gallon timestamp
+};
+
+enum logSource {LOG_EEPROM, LOG_SRAM, LOG_SD};
+
+struct logIter
+{
+	uint8_t source;			// logSource
+	uint8_t pin;			// SRAM: RTC chip select
+	logRegion *log;			// SD log
+	uint32_t seconds;		// bucket size of folded records, 0 for gallon timestamps
+	uint8_t bits;			// count bits of folded records
+	uint8_t checked;		// SD: the CRC of block pos was checked, see LogIter.cpp
+	uint32_t pos;			// SD: block sequence number, EEPROM and SRAM: address of the next record
+	uint16_t index;			// SD: next record in the block
+	uint16_t count;			// SD: records in the block, EEPROM and SRAM: end address
+	uint32_t lost;			// SD: blocks overwritten before they were read
+};
+
+void logIterEEPROM(logIter *it, uint16_t first, uint16_t end);
+void logIterSRAM(logIter *it, const uint8_t pin, uint8_t first, uint16_t end);
+void logIterSD(logIter *it, logRegion *log, uint32_t seconds, uint8_t bits);
+uint8_t logIterPeek(logIter *it, logRecord *rec);
+uint8_t logIterNext(logIter *it, logRecord *rec);
+uint8_t logIterSeek(logIter *it, uint32_t t_unix);
+uint8_t logIterPending(const logIter *it);
+uint8_t logIterBlockDone(const logIter *it);
+
+#endif
@@ -0,0 +1,104 @@
+#include <stddef.h>
+#include <string.h>
+#include <util/crc16.h>
+#include "ds3234.h"
+#include "LogStage.h"
+
+static logStageHeader stage;				// copy of the header in SRAM
+static uint32_t stageLast;					// newest staged record
+
+static uint16_t crcBytes(uint16_t crc, const void *buf, uint8_t n)
+{
+	const uint8_t *p = (const uint8_t *)buf;
+	while (n--)
+	{
+		crc = _crc16_update(crc, *p++);
+	}
+	return crc;
+}
+
+// seq is the next block the log will write
+uint8_t logStageInit(const uint8_t pin, uint32_t seq)
+{
+	DS3234_get_sram(pin, STAGE_HDR_ADDR, &stage, sizeof(stage));
+	if (stage.magic == STAGE_MAGIC && stage.count <= STAGE_RECORDS && stage.seq == seq
+		&& stage.crc == crcBytes(0xFFFF, &stage.seq, sizeof(stage.seq)))
+	{
+		// records left from before the reset
+		stageLast = stage.first;
+		for (uint8_t i = 1; i < stage.count; i++)
+		{
+			uint16_t gap;
+			DS3234_get_sram(pin, STAGE_REC_ADDR + i * sizeof(gap), &gap, sizeof(gap));
+			stageLast += gap;
+		}
+		return stage.count;
+	}
+	// lost RTC power, or the block was already written
+	logStageClear(pin, seq);
+	return 0;
+}
+
+// returns 0 if the record does not fit, the staged block must be written first
+uint8_t logStageAdd(const uint8_t pin, uint32_t record)
+{
+	if (stage.count >= STAGE_RECORDS)
+	{
+		return 0;							// full, waiting for logStageClear
+	}
+	if (stage.count == 0)
+	{
+		stage.first = record;
+		DS3234_set_sram(pin, STAGE_HDR_ADDR + offsetof(logStageHeader, first), &record, sizeof(record));
+	}
+	else if (record < stageLast || record - stageLast > STAGE_MAX_GAP)
+	{
+		return 0;							// clock set back, or a long gap
+	}
+	else
+	{
+		uint16_t gap = record - stageLast;
+		DS3234_set_sram(pin, STAGE_REC_ADDR + stage.count * sizeof(gap), &gap, sizeof(gap));
+	}
+	// the record only counts once the single count byte is written
+	stageLast = record;
+	stage.count++;
+	DS3234_set_sram_8b(pin, STAGE_HDR_ADDR + offsetof(logStageHeader, count), stage.count);
+	return stage.count;
+}
+
+uint8_t logStageCount()
+{
+	return stage.count;
+}
+
+void logStageRead(const uint8_t pin, logBlock *blk)
+{
+	memset(blk, 0, sizeof(logBlock));
+	if (stage.count == 0)
+	{
+		return;
+	}
+	// the gaps go at the end of rec, each whole time is written below the
+	// gaps not yet read
+	uint16_t *gap = (uint16_t *)&blk->rec[LOG_BLOCK_RECORDS] - stage.count;
+	DS3234_get_sram(pin, STAGE_REC_ADDR, gap, stage.count * sizeof(uint16_t));
+	uint32_t t = stage.first;
+	blk->rec[0] = t;
+	for (uint8_t i = 1; i < stage.count; i++)
+	{
+		t += gap[i];
+		blk->rec[i] = t;
+	}
+	blk->hdr.count = stage.count;
+}
+
+void logStageClear(const uint8_t pin, uint32_t seq)
+{
+	stage.magic = STAGE_MAGIC;
+	stage.count = 0;
+	stage.seq = seq;
+	stage.first = 0;
+	stage.crc = crcBytes(0xFFFF, &stage.seq, sizeof(stage.seq));
+	DS3234_set_sram(pin, STAGE_HDR_ADDR, &stage, sizeof(stage));
+}
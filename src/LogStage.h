@@ -0,0 +1,52 @@
+#ifndef __LogStage_h_
+#define __LogStage_h_
+
+#include <stdint.h>
+#include "LogBlock.h"
+
+/*
+  Battery-backed staging of gallon records for the SD log.
+
+  Records are collected in the DS3234 SRAM until a block's worth is
+  staged, then written to the card as one new log block with
+  logBlockWrite.  No card block is ever written more than once per lap
+  of the ring, and staged records survive a power cut since the SRAM is
+  kept up by the RTC battery.
+
+  The staging header holds the sequence number of the block the records
+  are for and the time of the first record.  Records are stored as the
+  seconds since the one before, so 50 fit where 26 whole times did.  A
+  record more than STAGE_MAX_GAP seconds after the last one, or before
+  it, does not fit and the block is written early.  A record is added by
+  writing it and then the count byte, so a reset part way through loses
+  at most that record.  If the card write completed but the staging was
+  not cleared before a power cut, logStageInit sees that the log has
+  moved past that block and discards the copy.
+
+  SRAM map: 0x00-0x8F see HotCounters.h, 0x90-0x9B header, 0x9C-0xFF
+  records.
+  All functions need the SPI bus set up for the RTC.
+*/
+
+#define STAGE_HDR_ADDR		0x90
+#define STAGE_REC_ADDR		0x9C
+#define STAGE_RECORDS		((0x100 - STAGE_REC_ADDR) / sizeof(uint16_t))
+#define STAGE_MAX_GAP		0xFFFFUL
+#define STAGE_MAGIC			0xA6		// 0xA5 staged whole times at 0x40 or 0x98, those are dropped
+
+struct logStageHeader
+{
+	uint8_t magic;			// STAGE_MAGIC
+	uint8_t count;			// records staged
+	uint16_t crc;			// CRC16 of seq
+	uint32_t seq;			// log block the records are for
+	uint32_t first;			// first record, the others are gaps from the one before
+};
+
+uint8_t logStageInit(const uint8_t pin, uint32_t seq);
+uint8_t logStageAdd(const uint8_t pin, uint32_t record);
+uint8_t logStageCount();
+void logStageRead(const uint8_t pin, logBlock *blk);
+void logStageClear(const uint8_t pin, uint32_t seq);
+
+#endif
@@ -0,0 +1,245 @@
+#ifndef __PersistentRing_h_
+#define __PersistentRing_h_
+
+#include <stdint.h>
+#include <string.h>
+#include <EEPROM.h>
+#ifdef __AVR__
+#include <util/crc16.h>
+#include "ds3234.h"
+#endif
+
+/*
+  Ring of fixed size records kept in a byte addressed store.
+
+  The layout is fixed at compile time from the record type and the
+  backend size: each slot is a 32 bit sequence number, the record bytes
+  and a CRC16 of both, and the record with sequence number seq is always
+  in slot seq % CAPACITY.  Nothing else is stored, so begin() finds the
+  head and tail with a binary search over the slots the same way
+  LogBlock.cpp does for the SD log, and a slot torn by a reset fails its
+  CRC and is written again.
+
+  A backend is a class with a SIZE constant and
+      void read(uint16_t addr, void *dst, uint16_t n);
+      void write(uint16_t addr, const void *src, uint16_t n);
+  that move whole slots at once, so a backend with block transfers uses
+  them.  Records are copied as raw bytes and must not hold pointers.
+
+  The closed rollup buckets are kept in rings in EEPROM (see Rollup.h).
+  The SD card has its own block ring in LogBlock.h.
+*/
+
+#ifndef __AVR__
+// same as avr-libc _crc16_update
+static inline uint16_t _crc16_update(uint16_t crc, uint8_t a)
+{
+	crc ^= a;
+	for (uint8_t i = 0; i < 8; i++)
+	{
+		crc = crc & 1 ? (crc >> 1) ^ 0xA001 : crc >> 1;
+	}
+	return crc;
+}
+#endif
+
+template <class Record, class Backend>
+class PersistentRing
+{
+public:
+	static const uint16_t SEQ_SIZE = sizeof(uint32_t);
+	static const uint16_t RECORD_SIZE = sizeof(Record);
+	static const uint16_t CRC_OFFSET = SEQ_SIZE + RECORD_SIZE;
+	static const uint16_t SLOT_SIZE = CRC_OFFSET + sizeof(uint16_t);
+	static const uint16_t CAPACITY = Backend::SIZE / SLOT_SIZE;
+
+	PersistentRing(Backend &backend) : backend_(backend), next_(0), count_(0) {}
+
+	// finds the head and tail, returns the number of records kept
+	uint32_t begin()
+	{
+		uint32_t seq0;
+		next_ = 0;
+		count_ = 0;
+		if (slotSeq(0, &seq0) && seq0 % CAPACITY == 0)
+		{
+			// slots 0..lo hold the lap that starts with slot 0
+			uint16_t lo = 0;
+			uint16_t hi = CAPACITY - 1;
+			while (lo < hi)
+			{
+				uint16_t mid = lo + (hi - lo + 1) / 2;
+				uint32_t seq;
+				if (slotSeq(mid, &seq) && seq == seq0 + mid)
+				{
+					lo = mid;
+				}
+				else
+				{
+					hi = mid - 1;
+				}
+			}
+			next_ = seq0 + lo + 1;
+		}
+		else
+		{
+			// slot 0 is empty or was torn starting a new lap
+			uint32_t seq;
+			if (slotSeq(CAPACITY - 1, &seq) && seq % CAPACITY == CAPACITY - 1)
+			{
+				next_ = seq + 1;
+			}
+		}
+		count_ = next_ < CAPACITY ? next_ : CAPACITY;
+		return count_;
+	}
+
+	void push(const Record &record)
+	{
+		uint8_t slot[SLOT_SIZE];
+		memcpy(slot, &next_, SEQ_SIZE);
+		memcpy(slot + SEQ_SIZE, &record, RECORD_SIZE);
+		uint16_t crc = slotCRC(slot);
+		memcpy(slot + CRC_OFFSET, &crc, sizeof(crc));
+		backend_.write(addr(next_ % CAPACITY), slot, SLOT_SIZE);
+		next_++;
+		if (count_ < CAPACITY)
+		{
+			count_++;
+		}
+	}
+
+	// record seq, if it is still kept and not torn
+	uint8_t read(uint32_t seq, Record *record)
+	{
+		uint8_t slot[SLOT_SIZE];
+		if (seq >= next_ || next_ - seq > count_ || !readSlot(seq % CAPACITY, slot))
+		{
+			return 0;
+		}
+		uint32_t stored;
+		memcpy(&stored, slot, SEQ_SIZE);
+		if (stored != seq)
+		{
+			return 0;
+		}
+		memcpy(record, slot + SEQ_SIZE, RECORD_SIZE);
+		return 1;
+	}
+
+	uint32_t head() const { return next_; }				// sequence number of the next record
+	uint32_t tail() const { return next_ - count_; }	// oldest record kept
+	uint32_t size() const { return count_; }
+
+private:
+	// fails to compile if not even two records fit
+	typedef char capacityCheck[CAPACITY > 1 ? 1 : -1];
+
+	static uint16_t addr(uint16_t slot)
+	{
+		return slot * SLOT_SIZE;
+	}
+
+	static uint16_t slotCRC(const uint8_t *slot)
+	{
+		uint16_t crc = 0xFFFF;
+		for (uint16_t i = 0; i < CRC_OFFSET; i++)
+		{
+			crc = _crc16_update(crc, slot[i]);
+		}
+		return crc;
+	}
+
+	uint8_t readSlot(uint16_t slot, uint8_t *buf)
+	{
+		uint16_t crc;
+		backend_.read(addr(slot), buf, SLOT_SIZE);
+		memcpy(&crc, buf + CRC_OFFSET, sizeof(crc));
+		return crc == slotCRC(buf);
+	}
+
+	uint8_t slotSeq(uint16_t slot, uint32_t *seq)
+	{
+		uint8_t buf[SLOT_SIZE];
+		if (!readSlot(slot, buf))
+		{
+			return 0;
+		}
+		memcpy(seq, buf, SEQ_SIZE);
+		return *seq % CAPACITY == slot;
+	}
+
+	Backend &backend_;
+	uint32_t next_;
+	uint32_t count_;
+};
+
+// RAM, for host builds and benchmarks
+template <uint16_t Size>
+class MemoryBackend
+{
+public:
+	enum {SIZE = Size};
+	uint8_t bytes[Size];
+	uint32_t bytesRead, bytesWritten;
+
+	MemoryBackend() : bytesRead(0), bytesWritten(0) { memset(bytes, 0xFF, Size); }
+	void read(uint16_t addr, void *dst, uint16_t n)
+	{
+		memcpy(dst, bytes + addr, n);
+		bytesRead += n;
+	}
+	void write(uint16_t addr, const void *src, uint16_t n)
+	{
+		memcpy(bytes + addr, src, n);
+		bytesWritten += n;
+	}
+};
+
+// part of the EEPROM, through the EEPROM library so writes are counted,
+// and only bytes that change are written
+template <uint16_t Start, uint16_t Size>
+class EEPROMBackend
+{
+public:
+	enum {SIZE = Size};
+	void read(uint16_t addr, void *dst, uint16_t n)
+	{
+		uint8_t *p = (uint8_t *)dst;
+		for (uint16_t i = 0; i < n; i++)
+		{
+			p[i] = EEPROM.read(Start + addr + i);
+		}
+	}
+	void write(uint16_t addr, const void *src, uint16_t n)
+	{
+		const uint8_t *p = (const uint8_t *)src;
+		for (uint16_t i = 0; i < n; i++)
+		{
+			if (EEPROM.read(Start + addr + i) != p[i])
+			{
+				EEPROM.write(Start + addr + i, p[i]);
+			}
+		}
+	}
+};
+
+#ifdef __AVR__
+// part of the DS3234 battery-backed SRAM, the SPI bus must be set up for the RTC
+template <uint8_t Start, uint16_t Size, uint8_t Pin>
+class DS3234Backend
+{
+public:
+	enum {SIZE = Size};
+	void read(uint16_t addr, void *dst, uint16_t n)
+	{
+		DS3234_get_sram(Pin, Start + addr, dst, n);
+	}
+	void write(uint16_t addr, const void *src, uint16_t n)
+	{
+		DS3234_set_sram(Pin, Start + addr, src, n);
+	}
+};
+#endif
+
+#endif
@@ -0,0 +1,84 @@
+#include <Arduino.h>
+#include <string.h>
+#ifdef __AVR__
+#include <avr/io.h>
+#endif
+#include "PowerDomain.h"
+
+static uint8_t holds[POWER_DOMAINS];
+static uint32_t since[POWER_DOMAINS];			// micros() at the first hold
+static uint32_t onMillis[POWER_DOMAINS];
+static uint16_t onMicros[POWER_DOMAINS];		// below a millisecond, carried to the next release
+
+#ifdef __AVR__
+static const uint8_t prrBits[POWER_DOMAINS] = {_BV(PRSPI), _BV(PRUSART0), _BV(PRADC), _BV(PRTWI), _BV(PRTIM1), _BV(PRTIM2)};
+#endif
+
+// stops everything, the caller then takes the holds it needs
+void powerInit()
+{
+	memset(holds, 0, sizeof(holds));
+	powerApply();
+}
+
+// sets the PRR from the holds, also after a sleep that changed it
+void powerApply()
+{
+#ifdef __AVR__
+	uint8_t prr = 0;
+	for (uint8_t i = 0; i < POWER_DOMAINS; i++)
+	{
+		if (!holds[i])
+		{
+			prr |= prrBits[i];
+		}
+	}
+	PRR &= ~_BV(PRADC);
+	if (holds[POWER_ADC])
+	{
+		ADCSRA |= _BV(ADEN);
+	}
+	else
+	{
+		ADCSRA &= ~_BV(ADEN);
+	}
+	PRR = prr;
+#endif
+}
+
+void powerAcquire(powerDomain domain)
+{
+	if (holds[domain]++ == 0)
+	{
+		since[domain] = micros();
+		powerApply();
+	}
+}
+
+void powerRelease(powerDomain domain)
+{
+	if (holds[domain] == 0 || --holds[domain] != 0)
+	{
+		return;
+	}
+	uint32_t us = micros() - since[domain] + onMicros[domain];
+	onMillis[domain] += us / 1000;
+	onMicros[domain] = us % 1000;
+	powerApply();
+}
+
+uint8_t powerHeld(powerDomain domain)
+{
+	return holds[domain];
+}
+
+// awake time the domain was held, including a hold still open
+uint32_t powerOnMillis(powerDomain domain)
+{
+	uint32_t ms = onMillis[domain];
+	if (holds[domain])
+	{
+		ms += (micros() - since[domain] + onMicros[domain]) / 1000;
+	}
+	return ms;
+}
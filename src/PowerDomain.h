@@ -0,0 +1,33 @@
+#ifndef __PowerDomain_h_
+#define __PowerDomain_h_
+
+#include <stdint.h>
+
+/*
+  Reference counted clock gating of the on-chip peripherals.
+
+  Every peripheral the firmware uses is held while it is needed and
+  released after, and one without holders is stopped in the power
+  reduction register, so an awake processor only clocks what the code
+  running at that moment uses.  Timer 0 is never gated since millis(),
+  micros() and delay() run from it.
+
+  A peripheral stopped in the PRR loses its setup, so whoever takes the
+  first hold sets it up again (SPI.begin, Serial.begin, SD init).  The
+  ADC is disabled before it is stopped, as the datasheet requires.
+
+  The time each domain was held is counted with micros(), which only
+  runs while awake.  Builds without __AVR__ do the counting and leave
+  out the register writes.
+*/
+
+enum powerDomain {POWER_SPI, POWER_USART, POWER_ADC, POWER_TWI, POWER_TIMER1, POWER_TIMER2, POWER_DOMAINS};
+
+void powerInit();
+void powerAcquire(powerDomain domain);
+void powerRelease(powerDomain domain);
+void powerApply();
+uint8_t powerHeld(powerDomain domain);
+uint32_t powerOnMillis(powerDomain domain);
+
+#endif
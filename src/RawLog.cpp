@@ -0,0 +1,124 @@
+#include <string.h>
+#include <util/crc16.h>
+#include "RawLog.h"
+
+static uint16_t superCRC(const rawLogSuper *sb)
+{
+	uint16_t crc = 0xFFFF;
+	const uint8_t *p = (const uint8_t *)sb;
+	const uint8_t *end = (const uint8_t *)&sb->crc;
+	while (p != end)
+	{
+		crc = _crc16_update(crc, *p++);
+	}
+	return crc;
+}
+
+// FAT and raw log partition types, anything else is not ours to touch
+static uint8_t knownType(uint8_t type)
+{
+	switch (type)
+	{
+	case 0x01:									// FAT12
+	case 0x04:									// FAT16 < 32 MB
+	case 0x06:									// FAT16
+	case 0x0B:									// FAT32
+	case 0x0C:									// FAT32 LBA
+	case 0x0E:									// FAT16 LBA
+	case RAW_LOG_PART_TYPE:
+		return 1;
+	}
+	return 0;
+}
+
+// finds the raw region from the MBR, first is the superblock
+static uint8_t findRegion(Sd2Card *card, uint8_t *buf, uint32_t *first, uint32_t *last)
+{
+	uint32_t size = card->cardSize();
+	if (size == 0 || !card->readBlock(0, buf))
+	{
+		return 0;
+	}
+	mbr_t *mbr = (mbr_t *)buf;
+	if (mbr->mbrSig0 != BOOTSIG0 || mbr->mbrSig1 != BOOTSIG1)
+	{
+		return 0;								// no partition table
+	}
+	// a FAT boot sector in block 0 also ends in 0x55AA - the region is
+	// erased, so refuse anything that is not a plain partition table
+	uint32_t end = 0;
+	part_t *raw = 0;
+	for (uint8_t i = 0; i < 4; i++)
+	{
+		part_t *p = &mbr->part[i];
+		if (p->type == 0)
+		{
+			continue;
+		}
+		if ((p->boot != 0x00 && p->boot != 0x80) || !knownType(p->type) || p->firstSector == 0
+			|| p->totalSectors == 0 || p->firstSector >= size || p->totalSectors > size - p->firstSector)
+		{
+			return 0;
+		}
+		if (p->type == RAW_LOG_PART_TYPE && p->totalSectors > 1 && !raw)
+		{
+			raw = p;
+		}
+		if (p->firstSector + p->totalSectors > end)
+		{
+			end = p->firstSector + p->totalSectors;
+		}
+	}
+	if (end == 0)
+	{
+		return 0;								// empty table
+	}
+	if (raw)
+	{
+		*first = raw->firstSector;
+		*last = raw->firstSector + raw->totalSectors - 1;
+		return 1;
+	}
+	// no raw partition - use the space after the partitions
+	if (size <= end + 1)
+	{
+		return 0;
+	}
+	*first = end;
+	*last = size - 1;
+	return 1;
+}
+
+uint8_t rawLogOpen(logRegion *log, Sd2Card *card)
+{
+	uint32_t first, last;
+	uint8_t *buf = SdVolume::cacheClear();
+	if (!findRegion(card, buf, &first, &last) || !card->readBlock(first, buf))
+	{
+		return 0;
+	}
+	rawLogSuper *sb = (rawLogSuper *)buf;
+	if (sb->magic != RAW_LOG_MAGIC || sb->version != RAW_LOG_VERSION || sb->crc != superCRC(sb)
+		|| sb->recordSize != sizeof(uint32_t) || sb->recordsPerBlock != LOG_BLOCK_RECORDS
+		|| sb->firstBlock != first + 1 || sb->blockCount != last - first)
+	{
+		// new or resized region - clear old blocks so none look like log blocks
+		if (!card->erase(first + 1, last))
+		{
+			return 0;
+		}
+		memset(buf, 0, 512);
+		sb->magic = RAW_LOG_MAGIC;
+		sb->version = RAW_LOG_VERSION;
+		sb->recordSize = sizeof(uint32_t);
+		sb->firstBlock = first + 1;
+		sb->blockCount = last - first;
+		sb->recordsPerBlock = LOG_BLOCK_RECORDS;
+		sb->crc = superCRC(sb);
+		if (!card->writeBlock(first, buf))
+		{
+			return 0;
+		}
+	}
+	return logBlockRecover(log, card, first + 1, last - first);
+}
@@ -0,0 +1,39 @@
+#ifndef __RawLog_h_
+#define __RawLog_h_
+
+#include <stdint.h>
+#include "LogBlock.h"
+
+/*
+  Raw partition log mode.
+
+  The gallon log is kept in a region of the card that has no file
+  system: an MBR partition of type RAW_LOG_PART_TYPE, or if there is
+  none, the space after the last partition.  A new region is erased, so
+  block 0 must be a partition table with only FAT and raw log entries,
+  each inside the card, or the card is left alone.  The first block of the
+  region is a superblock, the rest hold log blocks (see LogBlock.h)
+  written with Sd2Card block writes.  Records are staged in the volume
+  cache and each log block is written once, when it is full.
+
+  tools/rawlog_extract.cpp reads the log back out of a card image.
+*/
+
+#define RAW_LOG_MAGIC		0x474F4C52UL			// "RLOG"
+#define RAW_LOG_VERSION		1
+#define RAW_LOG_PART_TYPE	0xDA					// MBR type for non-file system data
+
+struct rawLogSuper
+{
+	uint32_t magic;			// RAW_LOG_MAGIC
+	uint16_t version;		// RAW_LOG_VERSION
+	uint16_t recordSize;	// bytes per record
+	uint32_t firstBlock;	// card block of the first log block
+	uint32_t blockCount;	// log blocks in the region
+	uint16_t recordsPerBlock;
+	uint16_t crc;			// CRC16 of the fields above
+};
+
+uint8_t rawLogOpen(logRegion *log, Sd2Card *card);
+
+#endif
@@ -0,0 +1,290 @@
+#include <EEPROM.h>
+#include "HotCounters.h"
+#include "PersistentRing.h"
+#include "Rollup.h"
+
+#define SLOT_SIZE(record)	(sizeof(uint32_t) + sizeof(record) + sizeof(uint16_t))	// see PersistentRing.h
+
+// an hour, or a day with the gallons held at 0xFFFF
+struct shortBucket
+{
+	uint32_t bucket;
+	uint16_t gallons;
+	uint16_t peak;
+};
+
+struct longBucket
+{
+	uint32_t bucket;
+	uint32_t gallons;
+	uint16_t peak;
+};
+
+#define HOUR_ADDR		(ROLLUP_START + 1)
+#define DAY_ADDR		(HOUR_ADDR + ROLLUP_HOURS * SLOT_SIZE(shortBucket))
+#define MONTH_ADDR		(DAY_ADDR + ROLLUP_DAYS * SLOT_SIZE(shortBucket))
+#define ROLLUP_END		(MONTH_ADDR + ROLLUP_MONTHS * SLOT_SIZE(longBucket))
+
+// fails to compile if the rings do not fit in the EEPROM
+typedef char eepromCheck[ROLLUP_END <= 1024 ? 1 : -1];
+
+typedef EEPROMBackend<HOUR_ADDR, ROLLUP_HOURS * SLOT_SIZE(shortBucket)> hourStore;
+typedef EEPROMBackend<DAY_ADDR, ROLLUP_DAYS * SLOT_SIZE(shortBucket)> dayStore;
+typedef EEPROMBackend<MONTH_ADDR, ROLLUP_MONTHS * SLOT_SIZE(longBucket)> monthStore;
+
+static hourStore hourBytes;
+static dayStore dayBytes;
+static monthStore monthBytes;
+static PersistentRing<shortBucket, hourStore> hours(hourBytes);
+static PersistentRing<shortBucket, dayStore> days(dayBytes);
+static PersistentRing<longBucket, monthStore> months(monthBytes);
+static uint8_t began;
+
+static const uint8_t slots[] = {ROLLUP_HOURS, ROLLUP_DAYS, ROLLUP_MONTHS};
+
+// year * 12 + month - 1, from the days since 1970
+static uint32_t monthNumber(uint32_t t_unix)
+{
+	uint32_t z = t_unix / 86400 + 719468;
+	uint32_t era = z / 146097;
+	uint32_t doe = z - era * 146097;
+	uint32_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	uint32_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	uint32_t mp = (5 * doy + 2) / 153;
+	uint32_t year = yoe + era * 400 + (mp >= 10);
+	return year * 12 + (mp < 10 ? mp + 2 : mp - 10);
+}
+
+static uint32_t bucket(uint8_t level, uint32_t t_unix)
+{
+	switch (level)
+	{
+		case ROLLUP_HOUR:
+			return t_unix / 3600;
+		case ROLLUP_DAY:
+			return t_unix / 86400;
+		default:
+			return monthNumber(t_unix);
+	}
+}
+
+// the bucket of the level above that bucket b of level falls in
+static uint32_t parent(uint8_t level, uint32_t b)
+{
+	return level == ROLLUP_HOUR ? b / 24 : monthNumber(b * 86400);
+}
+
+static void addTo(rollupEntry *entry, uint32_t gallons, uint16_t peak)
+{
+	entry->gallons += gallons;
+	if (peak < entry->peak)
+	{
+		entry->peak = peak;
+	}
+}
+
+// the record of bucket b, the rings are in bucket order
+template <class Ring, class Record>
+static uint8_t findClosed(Ring &ring, uint32_t b, Record *rec)
+{
+	for (uint32_t seq = ring.head(); seq-- > ring.tail(); )
+	{
+		if (ring.read(seq, rec) && rec->bucket <= b)
+		{
+			return rec->bucket == b;
+		}
+	}
+	return 0;
+}
+
+// adds the closed buckets of level that fall in bucket p of the level above
+template <class Ring, class Record>
+static void sumClosed(Ring &ring, Record *rec, uint8_t level, uint32_t p, rollupEntry *entry)
+{
+	for (uint32_t seq = ring.head(); seq-- > ring.tail(); )
+	{
+		if (!ring.read(seq, rec))
+		{
+			continue;
+		}
+		uint32_t q = parent(level, rec->bucket);
+		if (q < p)
+		{
+			break;
+		}
+		if (q == p)
+		{
+			addTo(entry, rec->gallons, rec->peak);
+		}
+	}
+}
+
+// the open bucket of level, the one hot.lastGallon is in
+static void sumOpen(uint8_t level, rollupEntry *entry)
+{
+	shortBucket rec;
+	if (hot.hourGallons)
+	{
+		addTo(entry, hot.hourGallons, hot.hourPeak);
+	}
+	if (level >= ROLLUP_DAY)
+	{
+		sumClosed(hours, &rec, ROLLUP_HOUR, bucket(ROLLUP_DAY, hot.lastGallon), entry);
+	}
+	if (level == ROLLUP_MONTH)
+	{
+		sumClosed(days, &rec, ROLLUP_DAY, bucket(ROLLUP_MONTH, hot.lastGallon), entry);
+	}
+}
+
+// closes the open hour, and its day and month if t_unix is past them
+static void closeBuckets(uint32_t t_unix)
+{
+	uint32_t last = hot.lastGallon;
+	shortBucket rec;
+	if (hot.hourGallons)
+	{
+		rec.bucket = bucket(ROLLUP_HOUR, last);
+		rec.gallons = hot.hourGallons;
+		rec.peak = hot.hourPeak;
+		hours.push(rec);
+		hot.hourGallons = 0;
+	}
+
+	uint32_t day = bucket(ROLLUP_DAY, last);
+	if (bucket(ROLLUP_DAY, t_unix) == day)
+	{
+		return;
+	}
+	rollupEntry entry = {0, ROLLUP_NO_PEAK};
+	sumClosed(hours, &rec, ROLLUP_HOUR, day, &entry);
+	if (entry.gallons)
+	{
+		rec.bucket = day;
+		rec.gallons = entry.gallons > 0xFFFF ? 0xFFFF : entry.gallons;
+		rec.peak = entry.peak;
+		days.push(rec);
+	}
+
+	uint32_t month = bucket(ROLLUP_MONTH, last);
+	if (bucket(ROLLUP_MONTH, t_unix) == month)
+	{
+		return;
+	}
+	entry.gallons = 0;
+	entry.peak = ROLLUP_NO_PEAK;
+	sumClosed(days, &rec, ROLLUP_DAY, month, &entry);
+	if (entry.gallons)
+	{
+		longBucket total = {month, entry.gallons, entry.peak};
+		months.push(total);
+	}
+}
+
+// finds the ring heads once, clears the rings if they were never set up
+static void begin()
+{
+	if (began)
+	{
+		return;
+	}
+	if (EEPROM.read(ROLLUP_START) != ROLLUP_MAGIC)
+	{
+		rollupClear();
+		return;
+	}
+	hours.begin();
+	days.begin();
+	months.begin();
+	began = 1;
+}
+
+void rollupClear()
+{
+	for (uint16_t addr = HOUR_ADDR; addr < ROLLUP_END; addr++)
+	{
+		if (EEPROM.read(addr) != 0xFF)
+		{
+			EEPROM.write(addr, 0xFF);
+		}
+	}
+	hours.begin();
+	days.begin();
+	months.begin();
+	began = 1;
+	hot.lastGallon = 0;
+	hot.hourGallons = 0;
+	EEPROM.write(ROLLUP_START, ROLLUP_MAGIC);
+}
+
+void rollupAdd(uint32_t t_unix)
+{
+	begin();
+	uint32_t last = hot.lastGallon;
+	if (last != 0 && t_unix > last && bucket(ROLLUP_HOUR, t_unix) != bucket(ROLLUP_HOUR, last))
+	{
+		closeBuckets(t_unix);
+	}
+	if (hot.hourGallons == 0)
+	{
+		hot.hourPeak = ROLLUP_NO_PEAK;
+	}
+	if (hot.hourGallons < 0xFFFF)
+	{
+		hot.hourGallons++;
+	}
+	if (last != 0 && t_unix >= last && t_unix - last < hot.hourPeak)
+	{
+		hot.hourPeak = t_unix - last;
+	}
+	// the clock going back counts in the open hour
+	if (t_unix > last)
+	{
+		hot.lastGallon = t_unix;
+	}
+}
+
+uint8_t rollupGet(rollupLevel level, uint32_t now, uint8_t ago, rollupEntry *entry)
+{
+	entry->gallons = 0;
+	entry->peak = ROLLUP_NO_PEAK;
+	uint32_t b = bucket(level, now);
+	if (ago >= slots[level] || ago > b)
+	{
+		return 0;
+	}
+	begin();
+	b -= ago;
+	if (hot.lastGallon != 0 && b >= bucket(level, hot.lastGallon))
+	{
+		if (b == bucket(level, hot.lastGallon))
+		{
+			sumOpen(level, entry);
+		}
+		return 1;							// newer buckets have no gallons yet
+	}
+	shortBucket rec;
+	longBucket total;
+	switch (level)
+	{
+		case ROLLUP_HOUR:
+			if (findClosed(hours, b, &rec))
+			{
+				addTo(entry, rec.gallons, rec.peak);
+			}
+			break;
+		case ROLLUP_DAY:
+			if (findClosed(days, b, &rec))
+			{
+				addTo(entry, rec.gallons, rec.peak);
+			}
+			break;
+		default:
+			if (findClosed(months, b, &total))
+			{
+				addTo(entry, total.gallons, total.peak);
+			}
+			break;
+	}
+	return 1;								// no record: no gallons, or aged out of the ring
+}
@@ -0,0 +1,52 @@
+#ifndef __Rollup_h_
+#define __Rollup_h_
+
+#include <stdint.h>
+
+/*
+  Hourly, daily and monthly water use.
+
+  Only the open hour, the one holding the newest gallon, changes with
+  every gallon.  Its count and the shortest time between two gallons in
+  it, which gives the peak flow, are kept in the RTC SRAM as
+  hot.hourGallons and hot.hourPeak next to hot.lastGallon, and saved by
+  the caller with the other hot counters (see HotCounters.h).
+
+  The first gallon in a later hour closes the open hour: it is pushed as
+  one record to a ring in EEPROM (see PersistentRing.h), and if the day
+  or the month ended too, that bucket is summed from the closed records
+  below it and pushed to its own ring.  EEPROM is written once per
+  closed bucket with gallons in it, never per gallon.  Losing the RTC
+  SRAM loses only the open hour.
+
+  The open day and month are summed from the closed records and the open
+  hour when they are read.  The hour ring keeps ROLLUP_HOURS records, so
+  it holds every closed hour of the open day, and the day ring keeps
+  ROLLUP_DAYS, every closed day of the open month.  A gallon timed
+  before the newest one, after the clock went back, counts in the open
+  hour.
+
+  The rings start after the EEPROM settings, over the old gallon log
+  that loadCounters takes over once at boot.
+*/
+
+#define ROLLUP_START		16			// EEPROM address of the magic byte, the rings follow
+#define ROLLUP_MAGIC		0x53		// 0x52 kept every bucket in EEPROM at 256
+#define ROLLUP_HOURS		24
+#define ROLLUP_DAYS			31
+#define ROLLUP_MONTHS		12
+#define ROLLUP_NO_PEAK		0xFFFF		// fewer than two gallons in the bucket
+
+enum rollupLevel {ROLLUP_HOUR, ROLLUP_DAY, ROLLUP_MONTH};
+
+struct rollupEntry
+{
+	uint32_t gallons;
+	uint16_t peak;			// shortest seconds between two gallons
+};
+
+void rollupAdd(uint32_t t_unix);
+uint8_t rollupGet(rollupLevel level, uint32_t now, uint8_t ago, rollupEntry *entry);
+void rollupClear();
+
+#endif
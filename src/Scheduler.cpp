@@ -0,0 +1,162 @@
+#include <Arduino.h>
+#include <avr/interrupt.h>
+#include "Scheduler.h"
+
+volatile uint8_t schedEvents;
+
+static schedTask *heap[SCHED_MAX_TASKS];
+static uint8_t heapSize;
+
+static void swap(uint8_t a, uint8_t b)
+{
+	schedTask *t = heap[a];
+	heap[a] = heap[b];
+	heap[b] = t;
+}
+
+static void siftUp(uint8_t i)
+{
+	while (i > 0)
+	{
+		uint8_t parent = (i - 1) / 2;
+		if (heap[parent]->due <= heap[i]->due)
+		{
+			break;
+		}
+		swap(i, parent);
+		i = parent;
+	}
+}
+
+static void siftDown(uint8_t i)
+{
+	for (;;)
+	{
+		uint8_t least = i;
+		uint8_t left = 2 * i + 1;
+		uint8_t right = left + 1;
+		if (left < heapSize && heap[left]->due < heap[least]->due)
+		{
+			least = left;
+		}
+		if (right < heapSize && heap[right]->due < heap[least]->due)
+		{
+			least = right;
+		}
+		if (least == i)
+		{
+			break;
+		}
+		swap(i, least);
+		i = least;
+	}
+}
+
+// safe to call from an ISR
+void schedPost(uint8_t events)
+{
+	uint8_t sreg = SREG;
+	cli();
+	schedEvents |= events;
+	SREG = sreg;
+}
+
+uint8_t schedTakeEvents()
+{
+	uint8_t sreg = SREG;
+	cli();
+	uint8_t events = schedEvents;
+	schedEvents = 0;
+	SREG = sreg;
+	return events;
+}
+
+// returns 0 if the queue is full
+uint8_t schedAdd(schedTask *task, uint32_t due)
+{
+	if (heapSize >= SCHED_MAX_TASKS)
+	{
+		return 0;
+	}
+	task->due = due;
+	heap[heapSize] = task;
+	siftUp(heapSize++);
+	return 1;
+}
+
+void schedRemove(schedTask *task)
+{
+	for (uint8_t i = 0; i < heapSize; i++)
+	{
+		if (heap[i] == task)
+		{
+			heap[i] = heap[--heapSize];
+			if (i < heapSize)
+			{
+				siftDown(i);
+				siftUp(i);
+			}
+			return;
+		}
+	}
+}
+
+uint32_t schedNextDue()
+{
+	return heapSize ? heap[0]->due : SCHED_NEVER;
+}
+
+// runs every task that is due, returns how many ran
+uint8_t schedRunDue(uint32_t now)
+{
+	uint8_t ran = 0;
+	while (heapSize && heap[0]->due <= now && ran < SCHED_MAX_TASKS)
+	{
+		schedTask *task = heap[0];
+		heap[0] = heap[--heapSize];
+		siftDown(0);
+
+		uint32_t start = micros();
+		task->run(now);
+		uint32_t took = micros() - start;
+		task->runs++;
+		task->micros += took;
+		if (took > task->maxMicros)
+		{
+			task->maxMicros = took;
+		}
+		ran++;
+
+		if (task->period)
+		{
+			uint32_t due = task->due + task->period;
+			if (due <= now)
+			{
+				due = now + task->period - (now - task->due) % task->period;	// missed runs are not made up, the phase is kept
+			}
+			schedAdd(task, due);
+		}
+	}
+	return ran;
+}
+
+// busy is set while a peripheral still needs its clock
+schedSleep schedSleepPolicy(uint32_t now, uint8_t busy)
+{
+	if (schedEvents || schedNextDue() <= now)
+	{
+		return SCHED_RUN;
+	}
+	return busy ? SCHED_IDLE : SCHED_POWER_DOWN;
+}
+
+uint8_t schedTaskCount()
+{
+	return heapSize;
+}
+
+// in heap order, not by due time
+schedTask *schedTaskAt(uint8_t i)
+{
+	return i < heapSize ? heap[i] : 0;
+}
@@ -0,0 +1,62 @@
+#ifndef __Scheduler_h_
+#define __Scheduler_h_
+
+#include <stdint.h>
+
+/*
+  Cooperative scheduler for the main loop.
+
+  Interrupts only post event bits with schedPost; the loop takes them
+  all at once with schedTakeEvents and handles them in order.  Periodic
+  work is a schedTask with a due time in unix seconds, kept in a min-heap
+  on the due time so the earliest deadline is always heap[0].  Tasks are
+  never run from an interrupt.
+
+  After the events are handled the loop calls schedRunDue, then asks
+  schedSleepPolicy how to sleep: not at all while there is work, idle
+  while a peripheral still needs its clock, otherwise power down until
+  schedNextDue (the caller sets the RTC alarm for it).
+
+  Each task keeps its run count and the time it took, from micros(), so
+  the cost of a task on a wake can be reported over the radio.
+*/
+
+#define SCHED_MAX_TASKS		6
+#define SCHED_NEVER			0xFFFFFFFFUL
+
+enum schedEvent
+{
+	EVENT_METER = 0x01,			// meter pin changed
+	EVENT_RADIO = 0x02,			// radio pulled the wake pin low
+	EVENT_ALARM = 0x04,			// RTC alarm 1
+	EVENT_POWER_FAIL = 0x08		// supply is going away, the report task checks it
+};
+
+enum schedSleep {SCHED_RUN, SCHED_IDLE, SCHED_POWER_DOWN};
+
+typedef void (*schedFunc)(uint32_t now);
+
+struct schedTask
+{
+	const char *name;
+	schedFunc run;
+	uint32_t period;		// seconds between runs, 0 to run once
+	uint32_t due;			// unix time of the next run
+	uint32_t runs;
+	uint32_t micros;		// total time spent in run
+	uint32_t maxMicros;		// longest single run
+};
+
+extern volatile uint8_t schedEvents;
+
+void schedPost(uint8_t events);
+uint8_t schedTakeEvents();
+uint8_t schedAdd(schedTask *task, uint32_t due);
+void schedRemove(schedTask *task);
+uint32_t schedNextDue();
+uint8_t schedRunDue(uint32_t now);
+schedSleep schedSleepPolicy(uint32_t now, uint8_t busy);
+uint8_t schedTaskCount();
+schedTask *schedTaskAt(uint8_t i);
+
+#endif
@@ -0,0 +1,71 @@
+#include <Arduino.h>
+#include <avr/interrupt.h>
+#include <util/crc16.h>
+#include "Trace.h"
+
+static traceEntry ring[TRACE_ENTRIES];
+static uint8_t next;					// slot of the next entry
+static uint8_t full;					// the ring has wrapped
+static volatile uint8_t paused;
+
+void trace(uint8_t id, uint8_t arg)
+{
+	if (paused)
+	{
+		return;
+	}
+	uint32_t now = micros();
+	uint8_t sreg = SREG;
+	cli();
+	traceEntry *e = &ring[next];
+	e->micros = now;
+	e->id = id;
+	e->arg = arg;
+	if (++next == TRACE_ENTRIES)
+	{
+		next = 0;
+		full = 1;
+	}
+	SREG = sreg;
+}
+
+void tracePause(uint8_t p)
+{
+	paused = p;
+}
+
+// buf must hold TRACE_FRAME_SIZE bytes, returns the bytes used
+uint16_t traceFrame(uint8_t *buf)
+{
+	uint8_t count = full ? TRACE_ENTRIES : next;
+	uint8_t slot = full ? next : 0;
+	uint8_t *p = buf + TRACE_HEADER_SIZE;
+	uint16_t crc = 0xFFFF;
+	buf[0] = 'T';
+	buf[1] = 'R';
+	buf[2] = 'C';
+	buf[3] = count;
+	buf[4] = TRACE_ENTRY_SIZE;
+	for (uint8_t i = 0; i < count; i++)
+	{
+		const traceEntry *e = &ring[slot];
+		uint8_t *start = p;
+		for (uint8_t b = 0; b < 32; b += 8)
+		{
+			*p++ = e->micros >> b;
+		}
+		*p++ = e->id;
+		*p++ = e->arg;
+		while (start < p)
+		{
+			crc = _crc16_update(crc, *start++);
+		}
+		if (++slot == TRACE_ENTRIES)
+		{
+			slot = 0;
+		}
+	}
+	*p++ = crc;
+	*p++ = crc >> 8;
+	return p - buf;
+}
@@ -0,0 +1,56 @@
+#ifndef __Trace_h_
+#define __Trace_h_
+
+#include <stdint.h>
+
+/*
+  Ring of timestamped firmware events for latency profiling in the field.
+
+  trace() stores micros(), an event id and one byte of argument, and is
+  safe from an ISR.  The ring keeps the newest TRACE_ENTRIES events.
+  micros() stops in power down, so time does not advance between
+  TRACE_SLEEP and the TRACE_WAKE after it.  The decoder treats that gap
+  as a sleep, not as latency.
+
+  traceFrame fills a buffer with the events oldest first, framed for the
+  radio as
+      'T' 'R' 'C' count entrySize  entries...  CRC16 of the entries
+  with the fields little endian, and recording is paused while the
+  frame is being sent.  tools/trace_decode.cpp turns captured frames
+  into a timeline and span latency histograms.  Keep the event ids in
+  step with it.
+*/
+
+#ifndef TRACE_ENTRIES
+#define TRACE_ENTRIES		32
+#endif
+#define TRACE_HEADER_SIZE	5
+#define TRACE_ENTRY_SIZE	6			// micros, id, arg as sent
+#define TRACE_FRAME_SIZE	(TRACE_HEADER_SIZE + TRACE_ENTRIES * TRACE_ENTRY_SIZE + 2)
+
+enum traceEvent
+{
+	TRACE_ISR = 1,			// arg: the event bit posted
+	TRACE_WAKE,				// arg: events pending after the sleep
+	TRACE_SLEEP,			// arg: schedSleep mode
+	TRACE_RTC_BEGIN,
+	TRACE_RTC_END,
+	TRACE_EEPROM_WRITE,		// arg: low byte of the address
+	TRACE_SD_BEGIN,			// block write
+	TRACE_SD_END,
+	TRACE_TX_BEGIN,			// radio
+	TRACE_TX_END
+};
+
+struct traceEntry
+{
+	uint32_t micros;
+	uint8_t id;
+	uint8_t arg;
+};
+
+void trace(uint8_t id, uint8_t arg);
+void tracePause(uint8_t paused);
+uint16_t traceFrame(uint8_t *buf);
+
+#endif
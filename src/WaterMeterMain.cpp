@@ -5,10 +5,41 @@
 #include <EEPROM.h>
 #include "ds3234.h"
 #include "LowPower.h"
+#include "LogBlock.h"
+#include "RawLog.h"
+#include "LogStage.h"
+#include "Rollup.h"
+#include "Compact.h"
+#include "LogIter.h"
+#include "HotCounters.h"
+#include "Scheduler.h"
+#include "PowerDomain.h"
+#include "EnergyStats.h"
+#include "Trace.h"
 
 // Define Constants
-#define LOG_START_POS		16			// memory position where gallon log starts
+#define LOG_START_POS		16			// EEPROM position where the old gallon log starts
 #define DEBOUNCE_MS			100			// time constant for debouncing in milliseconds
+#define METER_SETTLE_MS		250			// sleep after a meter edge before reading the pin
+#define GALLON_LOG_BLOCKS	1024		// blocks preallocated for the SD gallon log
+#define SD_RAW_LOG			0			// 1 keeps the gallon log in a raw region of the card with no FAT
+#define HOUR_LOG_BLOCKS		64			// blocks preallocated for hourly totals
+#define DAY_LOG_BLOCKS		32			// blocks preallocated for daily totals
+#define RAW_KEEP_DAYS		30			// days gallon timestamps are kept before folding into hours
+#define HOUR_KEEP_DAYS		90			// days hourly totals are kept before folding into days
+#define HOUR_COUNT_BITS		12			// gallon bits in an hourly total
+#define DAY_COUNT_BITS		16			// gallon bits in a daily total
+#define REPORT_SECONDS		80			// seconds between log reports, timed by RTC alarm 1
+#define COMPACT_SECONDS		80			// seconds between compaction runs, shares the report wake
+#define COMPACT_STEPS		10			// compaction steps per run, what ten 8 second wakes used to do
+#define CALIBRATE_SECONDS	21600		// seconds between watchdog calibrations against the RTC
+#define SUPPLY_FAIL_MV		2900		// below this the supply is failing, SD cards stop at 2700 mV
+#define LISTEN_SECONDS		300			// radio listen windows, on multiples of unix time the coordinator polls at
+#define LISTEN_MS			50			// a listen window closes this long after the last byte received
+#define RADIO_SESSION_MS	10000		// longest the coordinator can keep a window open with ALARM_PIN
+#define HEARTBEAT_REPORTS	15			// reports skipped for unchanged usage before one is sent anyway
+#define RADIO_WAKE_MAX_MS	1000		// longest wait for the radio to lower CTS
+#define RADIO_WAKE_MIN_MS	20			// shortest, however fast the radio has been waking
 
 // Define Pins Used for Operation
 #define RADIO_RX_PIN		0			// radio Rx pin
@@ -24,8 +55,9 @@
 #define MISO_PIN			12			// SPI MISO communication pin
 #define SPI_CLK_PIN			13			// SPI clock pin
 
-#define ALARM_PIN			2			// pin pulled low when Arduino is woken by the radio
+#define ALARM_PIN			2			// pulled low by the radio to wake the Arduino and hold a listen window open
 #define METER_PIN			3			// pin pulled low when one gallon has flowed through meter
+#define RTC_INT_PIN			5			// pulled low by the DS3234 when alarm 1 goes off (pin change interrupt)
 #define RST_PIN				6			// user reset pin, pulled low to reset
 
 #define VALVE_ENABLE_PIN	7			// pin must be pulled high to enable h bridge controller
@@ -33,39 +65,73 @@
 #define VALVE_CONTROL_2_PIN 9			// see above
 
 // Define Enumerations
-enum interruptType {NONE, RADIO, METER};
-enum SPIType {RTC, SDCard};
+enum SPIType {RTC, SDCard, SPIOff};
+enum outboxItem {OUTBOX_LOG = 0x01, OUTBOX_LEAK = 0x02};
 
 // Define Global Variables
 File logFile;
+logRegion gallonLog;						// SD gallon log, gallonLog.card is zero if not open
+logRegion hourLog, dayLog;					// SD hourly and daily totals
+compactLevel hourFold, dayFold;				// folds old gallons into hours, old hours into days
 static char MessageBuffer[256];
-uint8_t leak, timerCount;
+uint8_t leak;
+uint32_t alarmTime;							// what RTC alarm 1 is set for, SCHED_NEVER if off
 uint32_t meterIntTime, lastMeterIntTime;
-volatile interruptType lastInt;			// any variables changed by ISRs must be declared volatile
 SPIType SPIFunc;
-bool isBounce;
+uint8_t radioLink;							// USART held and Serial set up
+uint8_t radioOn;							// radio out of sleep, since radioOnMicros
+uint32_t radioOnMicros, sdOnMicros;
+uint32_t radioWakeMicros, radioWakeAvg8;	// last radio wake latency, and 8 times the running average
+uint16_t radioWakeTimeouts;
+uint8_t outbox;								// outboxItem bits waiting for the radio
+uint8_t listenDue;							// a listen window is due
+uint8_t quietReports;						// reports skipped since the last one sent
+uint32_t wdtWakesSaved, eepromWritesSaved;	// counts already added to stats
+uint8_t txActive;							// radio TX traced as started
+typedef char traceFrameFits[sizeof(MessageBuffer) >= TRACE_FRAME_SIZE ? 1 : -1];
 
 // Define Program Functions
+static void idleWhileSDBusy()
+{
+	// wake on the next timer 0 tick to poll the card again, PowerDomain keeps the rest gated
+	LowPower.idle(SLEEP_FOREVER,ADC_ON,TIMER2_ON,TIMER1_ON,TIMER0_ON,SPI_ON,USART0_ON,TWI_ON);
+}
+
 static uint8_t openLogFile()						// TODO: set this up to create new logs every month
 {
+#if SD_RAW_LOG
+	if(!SD.sdCard()->init(SPI_HALF_SPEED,SD_SS_PIN))	// no file system in raw mode
+	{
+		return 1;		// SD card error
+	}
+	return 0;
+#else
 	if(!SD.begin(4))
 	{
 		return 1;		// SD card error
 	}
+	uint16_t allocFailures = SD.fileAllocFailures();
 	logFile = SD.open("log.txt",FILE_WRITE);
 	if(logFile)
 	{
 		return 0;
+	}
+	else if(SD.fileAllocFailures() != allocFailures)
+	{
+		return 3;		// no free file slot
 	}
 	else
 	{
 		return 2;		// file open error
 	}
+#endif
 }
 
 static void closeLogFile()
 {
 	logFile.close();
+	// a multiple block read keeps the card selected between file reads
+	SD.sdCard()->readStop();
 }
 
 static uint8_t useSDCard()
@@ -76,10 +142,67 @@ static uint8_t useSDCard()
 	}
 	else
 	{
-		DS3234_end();
+		if(SPIFunc == RTC)
+		{
+			DS3234_end();
+		}
+		else
+		{
+			powerAcquire(POWER_SPI);
+		}
 		SPIFunc = SDCard;
+		sdOnMicros = micros();
 		return openLogFile();
 	}
+}
+
+#if !SD_RAW_LOG
+static uint8_t openLogRegion(const char *name, uint32_t blocks, logRegion *log)
+{
+	uint32_t bgnBlock, endBlock;
+	log->card = 0;
+	if(!SD.openContiguous(name,blocks*512UL,&bgnBlock,&endBlock))
+	{
+		return 2;		// file open error
+	}
+	if(!logBlockRecover(log,SD.sdCard(),bgnBlock,endBlock-bgnBlock+1))
+	{
+		log->card = 0;
+		return 3;		// log read error
+	}
+	return 0;
+}
+#endif
+
+static uint8_t openGallonLog()
+{
+	gallonLog.card = 0;
+	if(useSDCard())
+	{
+		return 1;		// SD card error
+	}
+#if SD_RAW_LOG
+	if(!rawLogOpen(&gallonLog,SD.sdCard()))
+	{
+		gallonLog.card = 0;
+		return 3;		// log read error
+	}
+#else
+	uint8_t err = openLogRegion("GALLONS.LOG",GALLON_LOG_BLOCKS,&gallonLog);
+	if(err)
+	{
+		return err;
+	}
+	if(!openLogRegion("HOURS.LOG",HOUR_LOG_BLOCKS,&hourLog) && !openLogRegion("DAYS.LOG",DAY_LOG_BLOCKS,&dayLog))
+	{
+		if(!compactInit(&hourFold,&gallonLog,0,0,&hourLog,3600,HOUR_COUNT_BITS,RAW_KEEP_DAYS*86400UL)
+			|| !compactInit(&dayFold,&hourLog,3600,HOUR_COUNT_BITS,&dayLog,86400,DAY_COUNT_BITS,HOUR_KEEP_DAYS*86400UL))
+		{
+			hourLog.card = 0;	// no retention, the gallon log just wraps
+		}
+	}
+#endif
+	return 0;
 }
 
 static uint8_t useRTC()
@@ -90,45 +213,197 @@ static uint8_t useRTC()
 	}
 	else
 	{
-		closeLogFile();
+		if(SPIFunc == SDCard)
+		{
+			closeLogFile();
+			statsAddTime(TIME_SD,sdOnMicros);
+		}
+		else
+		{
+			powerAcquire(POWER_SPI);
+		}
 		SPIFunc = RTC;
-		DS3234_init(DS3234_SS_PIN);;
+		DS3234_init(DS3234_SS_PIN);
 		return 0;
 	}
+}
+
+static uint32_t rtcClock()
+{
+	useRTC();
+	trace(TRACE_RTC_BEGIN,0);
+	uint32_t t_unix = DS3234_get_unix();
+	trace(TRACE_RTC_END,0);
+	return t_unix;
+}
+
+static void releaseSPI()
+{
+	if(SPIFunc == SPIOff)
+	{
+		return;
+	}
+	if(SPIFunc == SDCard)
+	{
+		closeLogFile();
+		statsAddTime(TIME_SD,sdOnMicros);
+	}
+	else
+	{
+		DS3234_end();
+	}
+	SPIFunc = SPIOff;
+	powerRelease(POWER_SPI);
 }
 
-static void wakeRadio()
+#if !SD_RAW_LOG
+static uint8_t writeStagedBlock()
+{
+	// the volume stays mounted while the RTC has the bus, only log.txt is closed
+	uint32_t start = micros();
+	useRTC();
+	logBlock *blk = (logBlock *)SdVolume::cacheClear();
+	logStageRead(DS3234_SS_PIN,blk);
+	DS3234_end();
+	uint32_t sdStart = micros();
+	uint8_t ok = SD.sdCard()->init(SPI_HALF_SPEED,SD_SS_PIN) && logBlockWrite(&gallonLog,blk);
+	statsAddTime(TIME_SD,sdStart);
+	DS3234_init(DS3234_SS_PIN);
+	statsAddTime(TIME_STORAGE,start);
+	if(!ok)
+	{
+		return 1;		// SD card error, records stay staged
+	}
+	logStageClear(DS3234_SS_PIN,logBlockNextSeq(&gallonLog));
+	return 0;
+}
+
+static void compactLogs(uint32_t now)
+{
+	// a few bounded steps per run, and only when a record is old enough
+	useRTC();
+	for(uint8_t i=0; i<COMPACT_STEPS; i++)
+	{
+		compactLevel *level = compactPending(&hourFold,now) ? &hourFold : compactPending(&dayFold,now) ? &dayFold : 0;
+		if(!level)
+		{
+			return;
+		}
+		DS3234_end();
+		uint32_t sdStart = micros();
+		uint8_t ok = SD.sdCard()->init(SPI_HALF_SPEED,SD_SS_PIN) && compactStep(level,now);
+		statsAddTime(TIME_SD,sdStart);
+		DS3234_init(DS3234_SS_PIN);
+		if(!ok)
+		{
+			return;
+		}
+	}
+}
+#endif
+
+// pin 16 is on port C, only enabled to end the sleep in waitForCTS
+ISR(PCINT1_vect)
+{
+}
+
+// idles until the radio lowers CTS, returns 0 on timeout
+static uint8_t waitForCTS(uint16_t timeoutMs)
 {
 	uint32_t tStart = millis();
+	uint8_t ready;
+	*digitalPinToPCMSK(RADIO_CTS_PIN) |= _BV(digitalPinToPCMSKbit(RADIO_CTS_PIN));
+	PCICR |= _BV(digitalPinToPCICRbit(RADIO_CTS_PIN));
+	while (!(ready = digitalRead(RADIO_CTS_PIN) == LOW) && millis()-tStart < timeoutMs)
+	{
+		// the CTS edge or the next timer 0 tick ends the sleep
+		LowPower.idle(SLEEP_FOREVER,ADC_ON,TIMER2_ON,TIMER1_ON,TIMER0_ON,SPI_ON,USART0_ON,TWI_ON);
+	}
+	*digitalPinToPCMSK(RADIO_CTS_PIN) &= ~_BV(digitalPinToPCMSKbit(RADIO_CTS_PIN));
+	return ready;
+}
+
+// four times the usual wake latency, the whole second until it is known
+static uint16_t radioWakeTimeout()
+{
+	uint32_t ms = radioWakeAvg8/2000;
+	if (!radioWakeAvg8 || ms > RADIO_WAKE_MAX_MS)
+	{
+		return RADIO_WAKE_MAX_MS;
+	}
+	return ms < RADIO_WAKE_MIN_MS ? RADIO_WAKE_MIN_MS : ms;
+}
+
+static uint8_t wakeRadio()
+{
+	if (radioOn)
+	{
+		return digitalRead(RADIO_CTS_PIN) == LOW || waitForCTS(RADIO_WAKE_MAX_MS);
+	}
+	radioOn = 1;
+	radioOnMicros = micros();
 	digitalWrite(RADIO_SLEEP_PIN,LOW);
-	while (digitalRead(RADIO_CTS_PIN))					// wait till radio wakes
+	if (!waitForCTS(radioWakeTimeout()))
 	{
-		if (millis()-tStart > 1000)
-			{
-				break;									// error connecting to radio
-			}
+		radioWakeTimeouts++;
+		radioWakeAvg8 = 0;								// slow or missing radio, wait the full time next wake
+		return 0;
 	}
-	delay(1);
+	radioWakeMicros = micros()-radioOnMicros;
+	radioWakeAvg8 = radioWakeAvg8 ? radioWakeAvg8-radioWakeAvg8/8+radioWakeMicros : radioWakeMicros*8;
+	return 1;
 }
 
 static void sleepRadio()
 {
+	if (radioOn)
+	{
+		statsAddTime(TIME_RADIO,radioOnMicros);
+		radioOn = 0;
+	}
 	digitalWrite(RADIO_SLEEP_PIN,HIGH);
 }
 
-static void cycleRadio()
+static void radioLinkUp()
 {
-	sleepRadio();
-	delay(1);
-	wakeRadio();
+	if (!radioLink)
+	{
+		powerAcquire(POWER_USART);
+		Serial.begin(9600,SERIAL_8N1);
+		radioLink = 1;
+	}
+}
+
+static void endTX()
+{
+	if (txActive)
+	{
+		trace(TRACE_TX_END,0);
+		txActive = 0;
+	}
+}
+
+static void radioLinkDown()
+{
+	if (radioLink)
+	{
+		Serial.flush();
+		endTX();
+		Serial.end();							// TX pin idles high as a plain output
+		powerRelease(POWER_USART);
+		radioLink = 0;
+	}
 }
 
 static uint8_t printSerial()
 {
-	if (digitalRead(RADIO_CTS_PIN))
+	radioLinkUp();
+	if (!txActive)
 	{
-		cycleRadio();
+		trace(TRACE_TX_BEGIN,0);
+		txActive = 1;
 	}
+	wakeRadio();										// CTS high mid-report is flow control, wait it out
 	return Serial.print(MessageBuffer);
 }
 
@@ -136,18 +411,19 @@ static void printTime()
 {
 	useRTC();
 	ts time;
+	trace(TRACE_RTC_BEGIN,1);
 	DS3234_get(DS3234_SS_PIN,&time);
+	trace(TRACE_RTC_END,1);
 	sprintf(MessageBuffer,"%02u/%02u/%4d %02d:%02d:%02d\t",time.mon,time.mday,time.year,time.hour,time.min,time.sec);
 	printSerial();
 }
 
 static void flushSerial()
 {
-	if (digitalRead(RADIO_CTS_PIN))
-	{
-		cycleRadio();
-	}
+	radioLinkUp();
+	wakeRadio();
 	Serial.flush();
+	endTX();
 }
 
 static void setValvePos(uint8_t pos)
@@ -170,13 +446,9 @@ static uint8_t wasLeakDetected()
 	return EEPROM.read(1);
 }
 
-static uint8_t getLastLogPos()
-{
-	return EEPROM.read(2);
-}
-
 static uint8_t closeValve()
 {
+	uint32_t start = micros();
 	digitalWrite(VALVE_ENABLE_PIN,1);
 	digitalWrite(VALVE_CONTROL_1_PIN,0);
 	digitalWrite(VALVE_CONTROL_2_PIN,1);
@@ -184,6 +456,7 @@ static uint8_t closeValve()
 	setValvePos(0);
 	digitalWrite(VALVE_ENABLE_PIN,0);
 	digitalWrite(VALVE_CONTROL_2_PIN,0);
+	statsAddTime(TIME_VALVE,start);
 	printTime();
 	sprintf(MessageBuffer,"Valve:\tClosed\n");
 	return printSerial();
@@ -191,6 +464,7 @@ static uint8_t closeValve()
 
 static uint8_t openValve()
 {
+	uint32_t start = micros();
 	digitalWrite(VALVE_ENABLE_PIN,1);
 	digitalWrite(VALVE_CONTROL_1_PIN,1);
 	digitalWrite(VALVE_CONTROL_2_PIN,0);
@@ -198,12 +472,14 @@ static uint8_t openValve()
 	setValvePos(1);
 	digitalWrite(VALVE_ENABLE_PIN,0);
 	digitalWrite(VALVE_CONTROL_1_PIN,0);
+	statsAddTime(TIME_VALVE,start);
 	printTime();
 	sprintf(MessageBuffer,"Valve:\tOpened\n");
 	return printSerial();
 }
 
 
+// counters used to be kept in EEPROM in this layout
 static uint32_t readLogEntry(uint8_t logStart)
 {
 	uint32_t t_unix = 0;
@@ -214,61 +490,35 @@ static uint32_t readLogEntry(uint8_t logStart)
 	return t_unix;
 }
 
-static void writeLogEntry(uint8_t startPos, uint32_t t_unix)
-{
-	// stores t_unix as 4 bytes
-	uint8_t splitByte;
-	splitByte = t_unix/16777216;
-	EEPROM.write(startPos,(char)splitByte);
-	t_unix -= (uint32_t)(splitByte)*16777216;
-	splitByte = t_unix/65536;
-	EEPROM.write(startPos+1,(char)splitByte);
-	t_unix -= (uint32_t)(splitByte)*65536;
-	splitByte = t_unix/256;
-	EEPROM.write(startPos+2,(char)splitByte);
-	t_unix -= (uint32_t)(splitByte)*256;
-	splitByte = t_unix;
-	EEPROM.write(startPos+3,t_unix);
-}
-
-static uint16_t getDayGallons()
-{
-	uint16_t dayGallons = 0;
-	dayGallons += (uint16_t)EEPROM.read(3)*256;
-	dayGallons += (uint16_t)EEPROM.read(4);
-	return dayGallons;
-}
-
-static void setDayGallons(uint16_t DayGallons)
-{
-	uint8_t splitByte;
-	splitByte = DayGallons/256;
-	EEPROM.write(3,splitByte);
-	DayGallons -= (uint32_t)(splitByte)*256;
-	splitByte = DayGallons;
-	EEPROM.write(4,DayGallons);
-}
-
-static uint8_t getConsecGallons()
+static void loadCounters()
 {
-	return EEPROM.read(5);
-}
-
-static void setConsecGallons(uint8_t gals)
-{
-	EEPROM.write(5,gals);
+	if (hotLoad(DS3234_SS_PIN))
+	{
+		return;
+	}
+	// first start with the counters in SRAM, or the RTC battery ran down
+	uint8_t lastLog = EEPROM.read(2);
+	if (lastLog <= 251)
+	{
+		// take over the EEPROM copies once
+		logIter it;
+		logRecord rec;
+		logIterEEPROM(&it,LOG_START_POS,lastLog+1);
+		while (logIterNext(&it,&rec) && hotAddRecord(DS3234_SS_PIN,rec.time));
+		hot.dayGallons = (uint16_t)EEPROM.read(3)*256+EEPROM.read(4);
+		hot.consecGallons = EEPROM.read(5);
+		hot.dayStart = readLogEntry(8);
+		EEPROM.write(2,0xFF);
+	}
+	hotSave(DS3234_SS_PIN);
 }
 
 static uint8_t clearLog()					// TODO: rewrite using SD card
 {											// TODO: rewrite for multiple month logs
-	uint8_t i;
-	if (getLastLogPos()!=LOG_START_POS-1)
+	useRTC();
+	if (hot.logCount)
 	{
-		for(i=LOG_START_POS; i<=251; i++)
-		{
-			EEPROM.write(i,(char)0);
-		}
-		EEPROM.write(2,(uint8_t)(LOG_START_POS-1));
+		hotClearRecords(DS3234_SS_PIN);
 	}
 	printTime();
 	sprintf(MessageBuffer,"Log:\tCleared\n");
@@ -280,8 +530,10 @@ static uint8_t resetSystem()
 	openValve();
 	clearLog();
 	setLeakCondition(0);
-	setDayGallons(0);
-	setConsecGallons(0);
+	useRTC();
+	hot.dayGallons = 0;
+	hot.consecGallons = 0;
+	hotSave(DS3234_SS_PIN);
 	printTime();
 	sprintf(MessageBuffer,"System Reset\n");
 	return printSerial();
@@ -289,47 +541,129 @@ static uint8_t resetSystem()
 
 static void radioInterrupt()
 {
-	lastInt = RADIO;
+	trace(TRACE_ISR,EVENT_RADIO);
+	schedPost(EVENT_RADIO);
 }
 
 static void meterInterrupt()
 {
-	lastInt = METER;
+	trace(TRACE_ISR,EVENT_METER);
+	schedPost(EVENT_METER);
+}
+
+// pin 5 is on port D
+ISR(PCINT2_vect)
+{
+	if (digitalRead(RTC_INT_PIN) == LOW)
+	{
+		trace(TRACE_ISR,EVENT_ALARM);
+		schedPost(EVENT_ALARM);
+	}
+}
+
+static void setWakeAlarm(uint32_t t_unix)
+{
+	// alarm 1 matches hours, minutes and seconds, so the time must be less than a day away
+	static const uint8_t flags[5] = {0,0,0,1,0};
+	uint32_t t_day = t_unix % 86400;
+	useRTC();
+	if (t_unix != SCHED_NEVER)
+	{
+		DS3234_set_a1(DS3234_SS_PIN,t_day%60,(t_day/60)%60,t_day/3600,1,flags);
+	}
+	DS3234_clear_a1f(DS3234_SS_PIN);					// releases the INT pin
+	DS3234_set_creg(DS3234_SS_PIN,t_unix != SCHED_NEVER ? DS3234_INTCN|DS3234_A1IE : DS3234_INTCN);
+	alarmTime = t_unix;
+}
+
+// the ISR that ended the sleep has posted its event by now
+static void countWake()
+{
+	uint8_t events = schedEvents;
+	if (events & EVENT_METER)
+	{
+		statsWake(WAKE_METER);
+	}
+	if (events & EVENT_RADIO)
+	{
+		statsWake(WAKE_RADIO);
+	}
+	if (events & EVENT_ALARM)
+	{
+		statsWake(WAKE_ALARM);
+	}
+	if (!events)
+	{
+		statsWake(WAKE_OTHER);
+	}
 }
 
 static void shutdown()
 {
 	sleep_enable();										// Dont fuck with anything below this point in this function
-	attachInterrupt(0,radioInterrupt,LOW);
+	if (digitalRead(ALARM_PIN) == HIGH)
+	{
+		attachInterrupt(0,radioInterrupt,LOW);			// a pin held past RADIO_SESSION_MS waits for the next listen window
+	}
 	attachInterrupt(1,meterInterrupt,CHANGE);
-	lastInt = NONE;
-	LowPower.powerDown(SLEEP_8S,ADC_OFF,BOD_OFF);
+	useRTC();
+	uint32_t due = schedNextDue();
+	if (due != alarmTime || digitalRead(RTC_INT_PIN) == LOW)
+	{
+		setWakeAlarm(due);								// also clears an alarm that went off a day early
+	}
+	uint32_t now = rtcClock();
+	uint8_t listening = digitalRead(RADIO_RTS_PIN) == LOW;
+	if (listening)
+	{
+		radioLinkUp();
+	}
+	else
+	{
+		radioLinkDown();
+	}
+	releaseSPI();
+	cli();												// an event posted after the check still wakes the sleep
+	switch (schedSleepPolicy(now,listening))
+	{
+	case SCHED_RUN:
+		sei();
+		break;
+	case SCHED_IDLE:									// the radio may still send
+		trace(TRACE_SLEEP,SCHED_IDLE);
+		LowPower.idle(SLEEP_FOREVER,ADC_ON,TIMER2_ON,TIMER1_ON,TIMER0_OFF,SPI_ON,USART0_ON,TWI_ON);
+		trace(TRACE_WAKE,schedEvents);
+		countWake();
+		break;
+	case SCHED_POWER_DOWN:								// until a gallon, the radio or the RTC alarm
+		trace(TRACE_SLEEP,SCHED_POWER_DOWN);
+		LowPower.powerDown(SLEEP_FOREVER,ADC_ON,BOD_OFF);
+		trace(TRACE_WAKE,schedEvents);
+		countWake();
+		break;
+	}
 }
 
 static uint8_t reportLog()// TODO: rewrite using SD card
 {
-	uint8_t lastLog = getLastLogPos();
-	uint8_t i;
+	logIter it;
+	logRecord rec;
+	uint8_t n = 0;
+	useRTC();
+	logIterSRAM(&it,DS3234_SS_PIN,HOT_LOG_ADDR,HOT_LOG_ADDR+hot.logCount*sizeof(uint32_t));
 	printTime();
 	sprintf(MessageBuffer,"Gallon Log:\n");
 	printSerial();
-	if (lastLog == LOG_START_POS-1)
+	if (!logIterPending(&it))
 	{
 		sprintf(MessageBuffer,"Empty\n");
 		printSerial();
 	}
-	else
+	while (logIterNext(&it,&rec))
 	{
-		for (i=LOG_START_POS;i<lastLog;i++)
-		{
-			if(i%4 == 0)
-			{
-				printTime();
-				sprintf(MessageBuffer,"%u\t%lu\n",(i-12)/4,readLogEntry((i)));
-				printSerial();
-			}
-
-		}
+		printTime();
+		sprintf(MessageBuffer,"%u\t%lu\n",++n,rec.time);
+		printSerial();
 	}
 	printTime();
 	sprintf(MessageBuffer,"End Log\n");
@@ -340,58 +674,82 @@ static void logGallon()// TODO: rewrite using SD card
 {
 	ts time;
 	uint32_t t_unix = 0;
-	uint8_t lastLog;
 	useRTC();
-	t_unix = DS3234_get_unix();
-	lastLog = getLastLogPos();
+	t_unix = rtcClock();
+	trace(TRACE_RTC_BEGIN,1);
 	DS3234_get(DS3234_SS_PIN,&time);
+	trace(TRACE_RTC_END,1);
 
-	if (lastLog>=95)
+	if (hot.logCount>=HOT_LOG_RECORDS)
 	{
 		reportLog();
 		clearLog();
 	}
 
-	lastLog = getLastLogPos();
-	writeLogEntry(lastLog+1,t_unix);				// writes gallon to log
-	EEPROM.write(2,lastLog+4);						// sets last log position
+	rollupAdd(t_unix);								// hour, day and month totals, sets hot.lastGallon
+	hotAddRecord(DS3234_SS_PIN,t_unix);				// writes gallon to log and saves hot
+
+#if SD_RAW_LOG
+	if(gallonLog.card && !useSDCard())
+	{
+		logBlockStage(&gallonLog,t_unix);			// one block write per full block
+	}
+#else
+	if(gallonLog.card)
+	{
+		// a record too long after the last staged one starts a new block
+		if(!logStageAdd(DS3234_SS_PIN,t_unix) && !writeStagedBlock())
+		{
+			logStageAdd(DS3234_SS_PIN,t_unix);
+		}
+		if(logStageCount() >= STAGE_RECORDS)
+		{
+			writeStagedBlock();						// each card block is written once
+		}
+	}
+#endif
 }
 
 static uint8_t checkForLeaks()											//TODO: rewrite using Sd log
 {
-	uint16_t dayGallons = getDayGallons();
-	uint32_t t_lastLog = readLogEntry(getLastLogPos()-3);
-	uint32_t t_prevLog = readLogEntry(getLastLogPos()-7);
-	uint32_t t_dayStart = readLogEntry(8);
-	uint8_t prevConsMins = getConsecGallons();
+	uint8_t leak = 0;
+	uint8_t n = hot.logCount;
+	if (n == 0)
+	{
+		return 0;
+	}
+	useRTC();
+	uint32_t t_lastLog = hotRecord(DS3234_SS_PIN,n-1);
+	logIter it;
+	logIterSRAM(&it,DS3234_SS_PIN,HOT_LOG_ADDR,HOT_LOG_ADDR+(n-1)*sizeof(uint32_t));		// gallons before the last one
+	uint8_t recentGallon = logIterSeek(&it,t_lastLog-60);
 
-	if (t_lastLog - t_dayStart >= 86400)		// full day has passed
+	if (t_lastLog - hot.dayStart >= 86400)		// full day has passed
 	{
-		writeLogEntry(8,t_lastLog);				// reset day start time
-		setDayGallons(0);						// reset day counter
+		hot.dayStart = t_lastLog;				// reset day start time
+		hot.dayGallons = 0;						// reset day counter
 	}
-	else
+	else if (++hot.dayGallons >= 1000)			// add gallon to daily log
 	{
-		setDayGallons(++dayGallons);			// add gallon to daily log
-		if (dayGallons >= 1000)
-		{
-			return 1;							// more than 1000 gallons used in one day
-		}
+		leak = 1;								// more than 1000 gallons used in one day
 	}
 
-	if (t_lastLog - t_prevLog <= 60)			// check if a minute has passed since last gallon logged
+	if (leak == 0)
 	{
-		setConsecGallons(++prevConsMins);		// log consecutive gallon
-		if (prevConsMins >= 120)
+		if (recentGallon)						// check if a minute has passed since last gallon logged
 		{
-			return 2;							// flow rate of 1 GPM or greater for 120+ consecutive mins
+			if (++hot.consecGallons >= 120)		// log consecutive gallon
+			{
+				leak = 2;						// flow rate of 1 GPM or greater for 120+ consecutive mins
+			}
+		}
+		else
+		{
+			hot.consecGallons = 0;				// reset consecutive gallon counter
 		}
 	}
-	else
-	{
-		setConsecGallons(0);					// reset consecutive gallon counter
-	}
-	return 0;									// no leak detected
+	hotSave(DS3234_SS_PIN);
+	return leak;
 }
 
 static uint8_t reportLeak()
@@ -435,6 +793,221 @@ static uint8_t reportValve()
 	return printSerial();
 }
 
+static uint8_t reportSDStats()
+{
+	sd_stats_t stats;
+	sdStatsSnapshot(&stats);
+	printTime();
+	sprintf(MessageBuffer,"SD:\tcmd %lu retry %lu busy %lu us cache %lu/%lu alloc fail %u\n",
+		stats.commands,stats.retries,stats.busyMicros,stats.cacheHits,stats.cacheMisses,
+		SD.fileAllocFailures());
+	printSerial();
+	printTime();
+	sprintf(MessageBuffer,"SD:\tread fat %lu mirror %lu dir %lu data %lu\n",
+		stats.blocksRead[SD_IO_FAT],stats.blocksRead[SD_IO_MIRROR],
+		stats.blocksRead[SD_IO_DIR],stats.blocksRead[SD_IO_DATA]);
+	printSerial();
+	printTime();
+	sprintf(MessageBuffer,"SD:\twrite fat %lu mirror %lu dir %lu data %lu\n",
+		stats.blocksWritten[SD_IO_FAT],stats.blocksWritten[SD_IO_MIRROR],
+		stats.blocksWritten[SD_IO_DIR],stats.blocksWritten[SD_IO_DATA]);
+	printSerial();
+	printTime();
+	sprintf(MessageBuffer,"Log:\tblock %lu records %u writes %lu staged %u\n",
+		gallonLog.seq,gallonLog.count,gallonLog.writes,logStageCount());
+	printSerial();
+	printTime();
+	sprintf(MessageBuffer,"Log:\tlost gallon blocks %lu hour blocks %lu\n",
+		hourFold.src.lost,dayFold.src.lost);
+	return printSerial();
+}
+
+static uint8_t reportRollups()
+{
+	static const char *names[] = {"hour", "day", "month"};
+	static const uint8_t counts[] = {ROLLUP_HOURS, ROLLUP_DAYS, ROLLUP_MONTHS};
+	rollupEntry entry;
+	useRTC();
+	uint32_t now = rtcClock();
+	printTime();
+	sprintf(MessageBuffer,"Use:\n");
+	printSerial();
+	for (uint8_t level=ROLLUP_HOUR; level<=ROLLUP_MONTH; level++)
+	{
+		for (uint8_t ago=0; ago<counts[level]; ago++)
+		{
+			if (!rollupGet((rollupLevel)level,now,ago,&entry) || entry.gallons == 0)
+			{
+				continue;
+			}
+			sprintf(MessageBuffer,"%s\t-%u\t%lu\t%u\n",names[level],ago,entry.gallons,entry.peak);
+			printSerial();
+		}
+	}
+	printTime();
+	sprintf(MessageBuffer,"End Use\n");
+	return printSerial();
+}
+
+static uint8_t clearSDStats()
+{
+	sdStatsReset();
+	printTime();
+	sprintf(MessageBuffer,"SD:\tCounters cleared\n");
+	return printSerial();
+}
+
+static void saveStats()
+{
+	uint32_t wdtWakes = LowPower.wdtWakes();
+	stats.wakes[WAKE_WDT] += wdtWakes - wdtWakesSaved;
+	wdtWakesSaved = wdtWakes;
+	stats.eepromWrites += EEPROM.writes - eepromWritesSaved;
+	eepromWritesSaved = EEPROM.writes;
+	useRTC();
+	statsSave(DS3234_SS_PIN);
+}
+
+static void traceEEPROM(int address)
+{
+	trace(TRACE_EEPROM_WRITE,address);
+}
+
+static void traceSD(uint8_t done)
+{
+	trace(done ? TRACE_SD_END : TRACE_SD_BEGIN,0);
+}
+
+// binary, see Trace.h
+static uint8_t dumpTrace()
+{
+	tracePause(1);
+	uint16_t n = traceFrame((uint8_t *)MessageBuffer);
+	radioLinkUp();
+	wakeRadio();
+	uint8_t ok = Serial.write((const uint8_t *)MessageBuffer,n) == n;
+	Serial.flush();
+	tracePause(0);
+	return ok;
+}
+
+static uint8_t reportStats()
+{
+	saveStats();
+	printTime();
+	sprintf(MessageBuffer,"Energy:\t%u wake %lu %lu %lu %lu %lu ms %lu %lu %lu %lu radio %lu sd %lu ee %lu\n",
+		stats.resets,stats.wakes[WAKE_WDT],stats.wakes[WAKE_METER],stats.wakes[WAKE_RADIO],
+		stats.wakes[WAKE_ALARM],stats.wakes[WAKE_OTHER],stats.ms[TIME_PULSE],stats.ms[TIME_REPORT],
+		stats.ms[TIME_VALVE],stats.ms[TIME_STORAGE],stats.ms[TIME_RADIO],stats.ms[TIME_SD],stats.eepromWrites);
+	return printSerial();
+}
+
+// AVcc in mV, from the 1.1 V bandgap measured against it
+static uint16_t readSupply()
+{
+	powerAcquire(POWER_ADC);
+	ADMUX = _BV(REFS0) | 0x0E;
+	delay(2);										// let the bandgap settle
+	ADCSRA |= _BV(ADSC);
+	while (ADCSRA & _BV(ADSC));
+	uint16_t adc = ADC;
+	powerRelease(POWER_ADC);
+	return adc ? 1125300UL / adc : 0;
+}
+
+static void reportTask(uint32_t)
+{
+	if (readSupply() < SUPPLY_FAIL_MV)
+	{
+		schedPost(EVENT_POWER_FAIL);							// no report, loop saves the stats instead
+		return;
+	}
+	// unchanged usage is only sent as a heartbeat
+	if (hot.logCount || ++quietReports >= HEARTBEAT_REPORTS)
+	{
+		outbox |= OUTBOX_LOG|OUTBOX_LEAK;
+		quietReports = 0;
+	}
+	saveStats();												// at most one report of counts is lost to a reset
+}
+
+static void listenTask(uint32_t)
+{
+	listenDue = 1;
+}
+
+// the radio must be awake
+static void sendOutbox()
+{
+	uint32_t start = micros();
+	if (outbox & OUTBOX_LOG)
+	{
+		reportLog();
+		clearLog();
+	}
+	if (outbox & OUTBOX_LEAK)
+	{
+		reportLeak();
+	}
+	outbox = 0;
+	statsAddTime(TIME_REPORT,start);
+}
+
+#if !SD_RAW_LOG
+static void compactTask(uint32_t now)
+{
+	uint32_t start = micros();
+	compactLogs(now);										// folds old log data, never on a meter wake
+	statsAddTime(TIME_STORAGE,start);
+}
+#endif
+
+static void calibrateTask(uint32_t)
+{
+	// a gallon or the radio aborts it, and it is tried again next time
+	attachInterrupt(0,radioInterrupt,LOW);
+	attachInterrupt(1,meterInterrupt,CHANGE);
+	LowPower.calibrate();
+	powerApply();											// calibrate turns the ADC back on
+	detachInterrupt(0);
+	detachInterrupt(1);
+}
+
+schedTask reportJob = {"report", reportTask, REPORT_SECONDS};
+schedTask calibrateJob = {"wdt", calibrateTask, CALIBRATE_SECONDS};
+schedTask listenJob = {"listen", listenTask, LISTEN_SECONDS};
+#if !SD_RAW_LOG
+schedTask compactJob = {"compact", compactTask, COMPACT_SECONDS};
+#endif
+
+static uint8_t reportTasks()
+{
+	printTime();
+	sprintf(MessageBuffer,"Tasks:\n");
+	printSerial();
+	for (uint8_t i=0; i<schedTaskCount(); i++)
+	{
+		schedTask *task = schedTaskAt(i);
+		sprintf(MessageBuffer,"%s\tdue %lu runs %lu us %lu max %lu\n",
+			task->name,task->due,task->runs,task->micros,task->maxMicros);
+		printSerial();
+	}
+	printTime();
+	sprintf(MessageBuffer,"WDT:\t1024 ms is %u ms\n",LowPower.wdtScale());
+	printSerial();
+	printTime();
+	sprintf(MessageBuffer,"Radio:\twake %lu us avg %lu us timeout %u ms missed %u\n",
+		radioWakeMicros,radioWakeAvg8/8,radioWakeTimeout(),radioWakeTimeouts);
+	printSerial();
+	printTime();
+	sprintf(MessageBuffer,"Power:\tspi %lu usart %lu adc %lu ms supply %u mV\n",
+		powerOnMillis(POWER_SPI),powerOnMillis(POWER_USART),powerOnMillis(POWER_ADC),readSupply());
+	printSerial();
+	printTime();
+	sprintf(MessageBuffer,"End Tasks\n");
+	return printSerial();
+}
+
 static void processRadio(uint8_t Signal)
 {
 	switch (Signal)
@@ -463,18 +1036,52 @@ static void processRadio(uint8_t Signal)
 		case 'k':
 			clearLeak();
 			break;
+		case 's':
+			reportSDStats();
+			break;
+		case 'x':
+			clearSDStats();
+			break;
+		case 'u':
+			reportRollups();
+			break;
+		case 't':
+			reportTasks();
+			break;
+		case 'e':
+			reportStats();
+			break;
+		case 'b':
+			dumpTrace();
+			break;
 		default:
 			break;
 	}
 }
 
-static void checkRadioCommands()
+// takes commands until LISTEN_MS pass without a byte and ALARM_PIN is released, the radio must be awake
+static void listenRadio()
 {
-	delay(10);										// wait for data to be received
-	while(Serial.available()>0)
+	radioLinkUp();
+	digitalWrite(RADIO_RTS_PIN,LOW);				// tell xBee we are available to receive data
+	uint32_t tStart = millis();
+	uint32_t tLast = tStart;
+	while (millis()-tLast < LISTEN_MS
+		|| (digitalRead(ALARM_PIN) == LOW && millis()-tStart < RADIO_SESSION_MS))
 	{
-		processRadio(Serial.read());
+		// the Serial RX interrupt queues the bytes, each byte is a whole command
+		if (Serial.available()>0)
+		{
+			processRadio(Serial.read());
+			tLast = millis();
+		}
+		else
+		{
+			// a received byte or the next timer 0 tick ends the sleep
+			LowPower.idle(SLEEP_FOREVER,ADC_ON,TIMER2_ON,TIMER1_ON,TIMER0_ON,SPI_ON,USART0_ON,TWI_ON);
+		}
 	}
+	digitalWrite(RADIO_RTS_PIN,HIGH);				// the xbee holds what it receives until the next window
 }
 
 
@@ -490,39 +1097,73 @@ void setup()
 
 	pinMode(ALARM_PIN,INPUT_PULLUP);
 	pinMode(METER_PIN,INPUT_PULLUP);
+	pinMode(RTC_INT_PIN,INPUT_PULLUP);
 
 	pinMode(RADIO_SLEEP_PIN,OUTPUT);
 	pinMode(RADIO_RTS_PIN,OUTPUT);
 	pinMode(RADIO_CTS_PIN,INPUT);
+	pinMode(RADIO_TX_PIN,OUTPUT);
 
 	digitalWrite(VALVE_ENABLE_PIN,0);
 	digitalWrite(VALVE_CONTROL_1_PIN,0);
 	digitalWrite(VALVE_CONTROL_2_PIN,0);
 	digitalWrite(SD_SS_PIN,1);
 	digitalWrite(DS3234_SS_PIN,1);
+	digitalWrite(RADIO_TX_PIN,1);				// idle level while the USART is stopped
+	digitalWrite(RADIO_RTS_PIN,1);				// radio holds what it receives until a listen window
 
 	pinMode(RST_PIN,INPUT_PULLUP);
 
+	// Stop every peripheral until it is used
+	powerInit();
+
 	// Initialize SPI Communication
+	powerAcquire(POWER_SPI);
 	DS3234_init(DS3234_SS_PIN);
 	SPIFunc = RTC;
+	loadCounters();								// counters that change every gallon are in RTC SRAM
+	statsLoad(DS3234_SS_PIN);
+	Sd2Card::busyCallback(idleWhileSDBusy);		// sleep instead of spinning while the SD card programs
+	Sd2Card::writeCallback(traceSD);
+	EEPROM.writeCallback(traceEEPROM);
+	if(!openGallonLog())						// finds the end of the SD log with a few block reads
+	{
+#if !SD_RAW_LOG
+		useRTC();
+		if(logStageInit(DS3234_SS_PIN,logBlockNextSeq(&gallonLog)) >= STAGE_RECORDS)
+		{
+			writeStagedBlock();					// filled before the last reset
+		}
+#endif
+	}
 
 	// Initialize Radio Communication
-	Serial.begin(9600,SERIAL_8N1);
+	radioLinkUp();
 	while(!Serial){;}
 
+	// Timed work runs on RTC alarm 1 wakes
+	LowPower.setClock(rtcClock);
+	useRTC();
+	uint32_t now = rtcClock();
+	schedAdd(&reportJob,now+REPORT_SECONDS);
+	schedAdd(&calibrateJob,now);				// first run straight after setup
+	schedAdd(&listenJob,now-now%LISTEN_SECONDS+LISTEN_SECONDS);
+#if !SD_RAW_LOG
+	schedAdd(&compactJob,now+COMPACT_SECONDS);
+#endif
+	alarmTime = SCHED_NEVER;
+	setWakeAlarm(schedNextDue());
+	*digitalPinToPCMSK(RTC_INT_PIN) |= _BV(digitalPinToPCMSKbit(RTC_INT_PIN));
+	PCICR |= _BV(digitalPinToPCICRbit(RTC_INT_PIN));
+
 	// Set Global Variables
 	leak = 0;
-	timerCount = -1;			// initialize at -1 since the first loop will increment this to 0before time has run
 	meterIntTime = 0;
 	lastMeterIntTime = 0;
-	lastInt = NONE;
-	isBounce = false;
 }
 
 void loop()
 {
-	digitalWrite(RADIO_RTS_PIN,LOW);			// tell xBee we are available to receive data
 	leak = 0;
 	if (!digitalRead(RST_PIN))
 	{
@@ -531,29 +1172,26 @@ void loop()
 	}
 	else
 	{
-		switch (lastInt)
+		uint8_t events = schedTakeEvents();
+		uint8_t radio = !(events & EVENT_POWER_FAIL);	// the radio would pull a failing supply down faster
+
+		if (events & EVENT_POWER_FAIL)
 		{
-		case NONE:
-			isBounce = false;						// wait until a few sleeps have happened then transmit data back
-			timerCount++;
-			if (timerCount >= 10)					// 10x 8 second intervals have passed
-			{
-				reportLog();
-				reportLeak();
-				clearLog();
-				timerCount = 0;
-			}
-			break;
-		case RADIO:
-												// I dont think we are going to implement radio wake yet since we are using AT mode for testing
-			break;
-		case METER:
+			saveStats();							// closes log.txt, staged records and counters are in battery-backed SRAM
+		}
+		if ((events & EVENT_RADIO) && radio)
+		{
+			wakeRadio();							// the coordinator woke us, its commands run before anything else
+			listenRadio();
+		}
+		if (events & EVENT_METER)
+		{
+			uint32_t start = micros();
 			sleep_enable();
-			LowPower.powerDown(SLEEP_250MS,ADC_OFF,BOD_OFF);		// wait 250ms before reading pin to avoid bounce
+			LowPower.sleepFor(METER_SETTLE_MS,ADC_ON,BOD_OFF);	// wait before reading pin to avoid bounce, in calibrated ms
 			sleep_disable();
 			if (digitalRead(METER_PIN) == LOW)
 			{
-				isBounce = false;
 				logGallon();
 				// check if a leak was previously detected
 				if (wasLeakDetected()==0)
@@ -564,25 +1202,31 @@ void loop()
 					{
 						setLeakCondition(leak);
 						closeValve();
-						reportLog();
-						reportLeak();
-						clearLog();
+						outbox |= OUTBOX_LOG|OUTBOX_LEAK;
 					}
 				}
 			}
-			else
+			statsAddTime(TIME_PULSE,start);
+		}
+
+		useRTC();
+		schedRunDue(rtcClock());				// reports, compaction, listen windows
+		radio = radio && !(schedEvents & EVENT_POWER_FAIL);	// the report task found the supply failing
+
+		// otherwise the radio only wakes to send or for a listen window
+		if ((outbox || listenDue) && radio)
+		{
+			wakeRadio();
+			sendOutbox();
+			if (listenDue)
 			{
-				isBounce = true;
+				listenRadio();
 			}
-			break;
 		}
-
-		if (!isBounce)
+		listenDue = 0;
+		if (radioOn)
 		{
-			cycleRadio();
-			checkRadioCommands();
 			flushSerial();
-			digitalWrite(RADIO_RTS_PIN,HIGH);	// tell xbee to stop sending data
 			sleepRadio();
 		}
 	}
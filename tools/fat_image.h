@@ -0,0 +1,145 @@
+/*
+  fat_image.h - blank card images for the host builds of the SD library
+
+  makeFatImage writes an MBR with one FAT16 or FAT32 partition starting
+  at block 64, like a new SD card, to an image file that the host
+  Sd2Card (arduinolib/utility/Sd2CardHost.cpp) can mount.  Only the
+  metadata is written, so the data area keeps whatever an earlier run
+  left there.  That stale data is what a real card has after files are
+  deleted.
+
+  Used by the sd_* tools, include it in one file only.
+*/
+
+#ifndef __fat_image_h_
+#define __fat_image_h_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define FAT_IMAGE_START		64			// first block of the partition
+
+static void putLE(uint8_t *p, uint32_t v, int n)
+{
+	for (int i = 0; i < n; i++)
+	{
+		p[i] = v >> (8 * i);
+	}
+}
+
+static int writeImageBlock(FILE *fd, uint32_t block, const uint8_t *b)
+{
+	return !fseeko(fd, (off_t)block * 512, SEEK_SET) && fwrite(b, 512, 1, fd) == 1;
+}
+
+// fatType 16 or 32, returns 0 on failure
+static int makeFatImage(const char *path, uint32_t blocks, int fatType)
+{
+	// no fcntl.h, its O_ flags would replace the SdFat ones
+	FILE *fd = fopen(path, "r+b");
+	if (!fd)
+	{
+		fd = fopen(path, "w+b");
+	}
+	if (!fd || ftruncate(fileno(fd), (off_t)blocks * 512))
+	{
+		return 0;
+	}
+	uint32_t total = blocks - FAT_IMAGE_START;
+	uint32_t reserved = fatType == 32 ? 32 : 1;
+	uint32_t perCluster = fatType == 32 ? 1 : 4;
+	uint32_t rootEntries = fatType == 32 ? 0 : 512;
+	uint32_t rootBlocks = rootEntries * 32 / 512;
+	uint32_t perEntry = fatType == 32 ? 4 : 2;
+
+	// FAT size for the clusters left after the FATs
+	uint32_t fatBlocks = 1;
+	for (;;)
+	{
+		uint32_t clusters = (total - reserved - 2 * fatBlocks - rootBlocks) / perCluster;
+		uint32_t need = ((clusters + 2) * perEntry + 511) / 512;
+		if (need <= fatBlocks)
+		{
+			break;
+		}
+		fatBlocks = need;
+	}
+
+	uint8_t b[512];
+	memset(b, 0, sizeof(b));
+	uint8_t *part = b + 446;
+	part[4] = fatType == 32 ? 0x0C : 0x06;
+	putLE(part + 8, FAT_IMAGE_START, 4);
+	putLE(part + 12, total, 4);
+	b[510] = 0x55;
+	b[511] = 0xAA;
+	int ok = writeImageBlock(fd, 0, b);
+
+	memset(b, 0, sizeof(b));
+	b[0] = 0xEB;
+	b[1] = 0x3C;
+	b[2] = 0x90;
+	memcpy(b + 3, "WMHOST  ", 8);
+	putLE(b + 11, 512, 2);
+	b[13] = perCluster;
+	putLE(b + 14, reserved, 2);
+	b[16] = 2;
+	putLE(b + 17, rootEntries, 2);
+	b[21] = 0xF8;
+	putLE(b + 32, total, 4);
+	if (fatType == 32)
+	{
+		putLE(b + 36, fatBlocks, 4);
+		putLE(b + 44, 2, 4);				// root directory cluster
+		putLE(b + 48, 1, 2);				// FSINFO block
+	}
+	else
+	{
+		putLE(b + 22, fatBlocks, 2);
+	}
+	b[510] = 0x55;
+	b[511] = 0xAA;
+	ok &= writeImageBlock(fd, FAT_IMAGE_START, b);
+
+	if (fatType == 32)
+	{
+		memset(b, 0, sizeof(b));
+		putLE(b, 0x41615252, 4);
+		putLE(b + 484, 0x61417272, 4);
+		putLE(b + 488, 0xFFFFFFFF, 4);		// free count unknown
+		putLE(b + 492, 0xFFFFFFFF, 4);
+		putLE(b + 508, 0xAA550000, 4);
+		ok &= writeImageBlock(fd, FAT_IMAGE_START + 1, b);
+	}
+
+	// FATs, entries 0 and 1 with the clean shutdown bit set, and the root directory
+	uint32_t fatStart = FAT_IMAGE_START + reserved;
+	for (uint32_t i = 0; i < fatBlocks; i++)
+	{
+		memset(b, 0, sizeof(b));
+		if (i == 0 && fatType == 32)
+		{
+			putLE(b, 0x0FFFFFF8, 4);
+			putLE(b + 4, 0x0FFFFFFF, 4);
+			putLE(b + 8, 0x0FFFFFFF, 4);	// root directory cluster
+		}
+		else if (i == 0)
+		{
+			putLE(b, 0xFFF8, 2);
+			putLE(b + 2, 0xFFFF, 2);
+		}
+		ok &= writeImageBlock(fd, fatStart + i, b);
+		ok &= writeImageBlock(fd, fatStart + fatBlocks + i, b);
+	}
+	memset(b, 0, sizeof(b));
+	uint32_t dirBlocks = fatType == 32 ? perCluster : rootBlocks;
+	for (uint32_t i = 0; i < dirBlocks; i++)
+	{
+		ok &= writeImageBlock(fd, fatStart + 2 * fatBlocks + i, b);
+	}
+	return !fclose(fd) && ok;
+}
+
+#endif
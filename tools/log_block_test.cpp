@@ -0,0 +1,149 @@
+/*
+  log_block_test - card writes per gallon log block (see src/LogBlock.h)
+
+  Usage: log_block_test [image]
+
+  Opens a contiguous log file on a card image the way the meter does and
+  fills blocks three ways: logBlockWrite with a block of STAGE_RECORDS
+  records from the RTC SRAM staging (see src/LogStage.h), logBlockStage
+  with the block in the volume cache, and logBlockStage again with
+  another cache user reading the card between records.  Each block must
+  cost exactly one data block write in sdStats.blocksWritten[SD_IO_DATA],
+  plus one per interruption in the last case, and every record must read
+  back.  logBlockAppend, one write per record, is printed for scale.
+  The image is /tmp/log_block_test.img unless given.  Exits with status
+  1 if any check fails.
+
+  Build on Linux with:
+    g++ -O2 -Iarduinolib -Isrc -o log_block_test tools/log_block_test.cpp \
+      src/LogBlock.cpp arduinolib/SD.cpp arduinolib/File.cpp \
+      arduinolib/utility/SdVolume.cpp arduinolib/utility/SdFile.cpp \
+      arduinolib/utility/Sd2CardHost.cpp
+*/
+
+#include <SD.h>
+#include <stdio.h>
+#include "LogBlock.h"
+#include "LogStage.h"
+#include "fat_image.h"
+
+#define IMAGE_BLOCKS	32768			// 16 MB FAT16
+#define LOG_BLOCKS		64
+#define BLOCKS			8				// filled per case, fewer than LOG_BLOCKS
+#define INTERRUPT_EVERY	50				// records between foreign cache reads
+
+enum method {METHOD_WRITE, METHOD_STAGE, METHOD_STAGE_SHARED, METHOD_APPEND, METHODS};
+
+static const char *methodNames[METHODS] = {"write", "stage", "stage shared", "append"};
+
+static uint32_t recordsPerBlock(method m)
+{
+	return m == METHOD_WRITE ? STAGE_RECORDS : LOG_BLOCK_RECORDS;
+}
+
+// every record written must read back in order
+static bool readBack(logRegion *log, uint32_t records)
+{
+	static logBlock blk;
+	uint32_t n = 0;
+	for (uint32_t seq = logBlockOldestSeq(log); seq <= log->seq; seq++)
+	{
+		if (!logBlockRead(log, seq, &blk))
+		{
+			return false;
+		}
+		for (uint16_t i = 0; i < blk.hdr.count; i++, n++)
+		{
+			if (blk.rec[i] != n)
+			{
+				return false;
+			}
+		}
+	}
+	return n == records;
+}
+
+static bool run(method m)
+{
+	static logBlock blk;
+	logRegion log;
+	uint32_t bgnBlock, endBlock;
+	if (!makeFatImage(sdHost.image, IMAGE_BLOCKS, 16))
+	{
+		perror(sdHost.image);
+		return false;
+	}
+	SdVolume::cacheClear();
+	if (!SD.begin(SD_CHIP_SELECT_PIN) || !SD.openContiguous("GALLONS.LOG", LOG_BLOCKS * 512UL, &bgnBlock, &endBlock)
+		|| !logBlockRecover(&log, SD.sdCard(), bgnBlock, endBlock - bgnBlock + 1))
+	{
+		fprintf(stderr, "%s: setup failed\n", methodNames[m]);
+		return false;
+	}
+
+	uint32_t records = BLOCKS * recordsPerBlock(m);
+	uint32_t interrupts = 0;
+	sdStatsReset();
+	for (uint32_t n = 0; n < records; n++)
+	{
+		bool ok = true;
+		switch (m)
+		{
+		case METHOD_WRITE:
+			if (n % STAGE_RECORDS == 0)
+			{
+				memset(&blk, 0, sizeof(blk));
+			}
+			blk.rec[blk.hdr.count++] = n;
+			ok = blk.hdr.count < STAGE_RECORDS || logBlockWrite(&log, &blk);
+			break;
+		case METHOD_STAGE_SHARED:
+			if (n % INTERRUPT_EVERY == INTERRUPT_EVERY - 1)
+			{
+				// a LogIter or FAT access takes the cache
+				ok = SdVolume::cacheRead(SD.sdCard(), bgnBlock - 1) != 0;
+				interrupts += log.count != 0;
+			}
+			// fall through
+		case METHOD_STAGE:
+			ok = ok && logBlockStage(&log, n);
+			break;
+		default:
+			ok = logBlockAppend(&log, n);
+			break;
+		}
+		if (!ok)
+		{
+			fprintf(stderr, "%s: write failed at record %u\n", methodNames[m], n);
+			return false;
+		}
+	}
+	uint32_t data = sdStats.blocksWritten[SD_IO_DATA];
+	uint32_t other = sdStats.blocksWritten[SD_IO_FAT] + sdStats.blocksWritten[SD_IO_MIRROR]
+		+ sdStats.blocksWritten[SD_IO_DIR];
+	printf("%-13s %u blocks, %u records: %u data writes, %.2f per block, %u other\n",
+		methodNames[m], BLOCKS, records, data, (double)data / BLOCKS, other);
+
+	bool pass = readBack(&log, records) && other == 0;
+	if (m != METHOD_APPEND && data != BLOCKS + interrupts)
+	{
+		fprintf(stderr, "%s: expected %u data writes\n", methodNames[m], BLOCKS + interrupts);
+		pass = false;
+	}
+	return pass;
+}
+
+int main(int argc, char **argv)
+{
+	sdHost.image = argc > 1 ? argv[1] : "/tmp/log_block_test.img";
+	int failed = 0;
+	for (int m = 0; m < METHODS; m++)
+	{
+		if (!run((method)m))
+		{
+			fprintf(stderr, "%s: FAIL\n", methodNames[m]);
+			failed = 1;
+		}
+	}
+	return failed;
+}
@@ -0,0 +1,226 @@
+/*
+  rawlog_extract - read the raw partition gallon log out of a card image
+
+  Usage: rawlog_extract <card image> [first seq]
+
+  Finds the log region the same way the meter does (see src/RawLog.h),
+  checks the superblock and prints every valid record in sequence order
+  as "seq<TAB>index<TAB>unix time<TAB>UTC time".  Blocks that fail their
+  CRC are reported on stderr and skipped.
+
+  Build on Linux with: g++ -O2 -o rawlog_extract tools/rawlog_extract.cpp
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <vector>
+
+// on-card layout, see src/LogBlock.h and src/RawLog.h
+#define LOG_BLOCK_MAGIC		0x4C4F4731UL
+#define RAW_LOG_MAGIC		0x474F4C52UL
+#define RAW_LOG_VERSION		1
+#define RAW_LOG_PART_TYPE	0xDA
+
+struct __attribute__((packed)) logBlockHeader
+{
+	uint32_t magic;
+	uint32_t seq;
+	uint16_t count;
+	uint16_t crc;
+};
+
+#define LOG_BLOCK_RECORDS	((512 - sizeof(logBlockHeader)) / sizeof(uint32_t))
+
+struct __attribute__((packed)) logBlock
+{
+	logBlockHeader hdr;
+	uint32_t rec[LOG_BLOCK_RECORDS];
+};
+
+struct __attribute__((packed)) rawLogSuper
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t recordSize;
+	uint32_t firstBlock;
+	uint32_t blockCount;
+	uint16_t recordsPerBlock;
+	uint16_t crc;
+};
+
+static FILE *image;
+static uint32_t imageBlocks;
+
+// same as avr-libc _crc16_update
+static uint16_t crc16Update(uint16_t crc, uint8_t a)
+{
+	crc ^= a;
+	for (int i = 0; i < 8; i++)
+	{
+		crc = crc & 1 ? (crc >> 1) ^ 0xA001 : crc >> 1;
+	}
+	return crc;
+}
+
+static uint16_t crc16(uint16_t crc, const void *buf, size_t n)
+{
+	const uint8_t *p = (const uint8_t *)buf;
+	while (n--)
+	{
+		crc = crc16Update(crc, *p++);
+	}
+	return crc;
+}
+
+static bool readBlock(uint32_t block, void *dst)
+{
+	if (block >= imageBlocks || fseeko(image, (off_t)block * 512, SEEK_SET))
+	{
+		return false;
+	}
+	return fread(dst, 512, 1, image) == 1;
+}
+
+// same rules as knownType() in src/RawLog.cpp
+static bool knownType(uint8_t type)
+{
+	return type == 0x01 || type == 0x04 || type == 0x06 || type == 0x0B || type == 0x0C
+		|| type == 0x0E || type == RAW_LOG_PART_TYPE;
+}
+
+static bool findRegion(uint32_t *first, uint32_t *last)
+{
+	uint8_t mbr[512];
+	if (!readBlock(0, mbr) || mbr[510] != 0x55 || mbr[511] != 0xAA)
+	{
+		return false;
+	}
+	uint32_t end = 0;
+	bool raw = false;
+	for (int i = 0; i < 4; i++)
+	{
+		const uint8_t *p = mbr + 446 + 16 * i;
+		uint32_t firstSector, totalSectors;
+		memcpy(&firstSector, p + 8, 4);
+		memcpy(&totalSectors, p + 12, 4);
+		if (p[4] == 0)
+		{
+			continue;
+		}
+		if ((p[0] != 0x00 && p[0] != 0x80) || !knownType(p[4]) || firstSector == 0
+			|| totalSectors == 0 || firstSector >= imageBlocks || totalSectors > imageBlocks - firstSector)
+		{
+			return false;						// the meter does not use this card
+		}
+		if (p[4] == RAW_LOG_PART_TYPE && totalSectors > 1 && !raw)
+		{
+			*first = firstSector;
+			*last = firstSector + totalSectors - 1;
+			raw = true;
+		}
+		if (firstSector + totalSectors > end)
+		{
+			end = firstSector + totalSectors;
+		}
+	}
+	if (raw)
+	{
+		return true;
+	}
+	if (end == 0 || imageBlocks <= end + 1)
+	{
+		return false;
+	}
+	*first = end;
+	*last = imageBlocks - 1;
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2)
+	{
+		fprintf(stderr, "usage: %s <card image> [first seq]\n", argv[0]);
+		return 2;
+	}
+	uint32_t fromSeq = argc > 2 ? strtoul(argv[2], 0, 0) : 0;
+	image = fopen(argv[1], "rb");
+	if (!image)
+	{
+		perror(argv[1]);
+		return 1;
+	}
+	fseeko(image, 0, SEEK_END);
+	imageBlocks = ftello(image) / 512;
+
+	uint32_t first, last;
+	rawLogSuper sb;
+	uint8_t buf[512];
+	if (!findRegion(&first, &last) || !readBlock(first, buf))
+	{
+		fprintf(stderr, "no raw log region\n");
+		return 1;
+	}
+	memcpy(&sb, buf, sizeof(sb));
+	if (sb.magic != RAW_LOG_MAGIC || sb.version != RAW_LOG_VERSION
+		|| sb.crc != crc16(0xFFFF, &sb, offsetof(rawLogSuper, crc))
+		|| sb.recordsPerBlock != LOG_BLOCK_RECORDS || sb.recordSize != 4)
+	{
+		fprintf(stderr, "bad superblock at block %u\n", first);
+		return 1;
+	}
+
+	// find the valid blocks, then print them in sequence order
+	std::vector<std::pair<uint32_t, uint32_t> > blocks;		// seq, slot
+	logBlock blk;
+	uint32_t torn = 0;
+	for (uint32_t slot = 0; slot < sb.blockCount; slot++)
+	{
+		if (!readBlock(sb.firstBlock + slot, &blk))
+		{
+			fprintf(stderr, "read error at block %u\n", sb.firstBlock + slot);
+			return 1;
+		}
+		if (blk.hdr.magic != LOG_BLOCK_MAGIC)
+		{
+			continue;
+		}
+		uint32_t seq = blk.hdr.seq;
+		uint16_t count = blk.hdr.count;
+		if (count > LOG_BLOCK_RECORDS || seq % sb.blockCount != slot
+			|| blk.hdr.crc != crc16(crc16(0xFFFF, &blk.hdr.seq, 6), blk.rec, 4 * count))
+		{
+			fprintf(stderr, "torn block in slot %u\n", slot);
+			torn++;
+			continue;
+		}
+		if (seq >= fromSeq)
+		{
+			blocks.push_back(std::make_pair(seq, slot));
+		}
+	}
+	std::sort(blocks.begin(), blocks.end());
+
+	uint32_t records = 0;
+	for (size_t i = 0; i < blocks.size(); i++)
+	{
+		readBlock(sb.firstBlock + blocks[i].second, &blk);
+		for (uint16_t j = 0; j < blk.hdr.count; j++)
+		{
+			time_t t = blk.rec[j];
+			char when[32];
+			strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", gmtime(&t));
+			printf("%u\t%u\t%u\t%s\n", blk.hdr.seq, j, blk.rec[j], when);
+			records++;
+		}
+	}
+	fprintf(stderr, "%u records in %u blocks, %u torn, region %u..%u\n",
+		records, (uint32_t)blocks.size(), torn, first, last);
+	fclose(image);
+	return 0;
+}
@@ -0,0 +1,105 @@
+/*
+  ring_bench - host throughput of PersistentRing (see src/PersistentRing.h)
+
+  Usage: ring_bench [records]
+
+  Runs the ring over RAM backends the size of the meter's EEPROM, the
+  DS3234 SRAM and a larger store, and prints pushes and reads per second,
+  the bytes moved per record and the bytes read by begin().  Each run
+  also tears the newest slot and checks that begin() drops only that
+  record.
+
+  Build on Linux with: g++ -O2 -Iarduinolib -Isrc -o ring_bench tools/ring_bench.cpp
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "PersistentRing.h"
+
+struct bucket
+{
+	uint32_t time;
+	uint16_t gallons;
+	uint16_t peak;
+};
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+template <class Record, uint16_t Size>
+static int bench(const char *name, uint32_t records)
+{
+	typedef PersistentRing<Record, MemoryBackend<Size> > Ring;
+	static MemoryBackend<Size> store;
+	memset(store.bytes, 0xFF, Size);
+	store.bytesRead = store.bytesWritten = 0;
+	Ring ring(store);
+	ring.begin();
+
+	Record r;
+	memset(&r, 0, sizeof(r));
+	double t0 = now();
+	for (uint32_t i = 0; i < records; i++)
+	{
+		*(uint32_t *)&r = i;
+		ring.push(r);
+	}
+	double t1 = now();
+	uint32_t written = store.bytesWritten;
+
+	uint32_t bad = 0;
+	uint32_t reads = 0;
+	store.bytesRead = 0;
+	for (uint32_t pass = 0; reads < records; pass++)
+	{
+		for (uint32_t seq = ring.tail(); seq < ring.head() && reads < records; seq++, reads++)
+		{
+			if (!ring.read(seq, &r) || *(uint32_t *)&r != seq)
+			{
+				bad++;
+			}
+		}
+	}
+	double t2 = now();
+
+	// recover, then tear the newest slot and recover again
+	store.bytesRead = 0;
+	Ring again(store);
+	uint32_t kept = again.begin();
+	uint32_t scanBytes = store.bytesRead;
+	if (again.head() != records || kept != (records < Ring::CAPACITY ? records : (uint32_t)Ring::CAPACITY))
+	{
+		bad++;
+	}
+	store.bytes[((records - 1) % Ring::CAPACITY) * Ring::SLOT_SIZE + Ring::SEQ_SIZE] ^= 0x5A;
+	Ring torn(store);
+	torn.begin();
+	if (torn.head() != records - 1)
+	{
+		bad++;
+	}
+
+	printf("%-8s %5u B %2u B/slot %4u slots  %6.1f M push/s  %6.1f M read/s  %4.1f B written/rec  begin %4u B  %s\n",
+		name, Size, (unsigned)Ring::SLOT_SIZE, (unsigned)Ring::CAPACITY,
+		records / (t1 - t0) / 1e6, reads / (t2 - t1) / 1e6,
+		(double)written / records, scanBytes, bad ? "FAIL" : "ok");
+	return bad != 0;
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t records = argc > 1 ? strtoul(argv[1], 0, 0) : 10000000;
+	int fail = 0;
+	fail |= bench<uint32_t, 1024>("eeprom", records);
+	fail |= bench<uint32_t, 256>("sram", records);
+	fail |= bench<uint32_t, 65535>("64k", records);
+	fail |= bench<bucket, 1024>("eeprom", records);
+	fail |= bench<bucket, 256>("sram", records);
+	fail |= bench<bucket, 65535>("64k", records);
+	return fail;
+}
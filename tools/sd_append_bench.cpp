@@ -0,0 +1,144 @@
+/*
+  sd_append_bench - append and readback cost of the SD library on a card image
+
+  Usage: sd_append_bench [command us] [busy us] [image]
+
+  Appends records to a log file the way the meter does, syncing after
+  each one, with write(), with write() in lazy metadata mode and with
+  appendBuffer() and appendCommit() in lazy mode, then reads the file
+  back.  Prints the time per record and the blocks written per record
+  by class (sdStats), and the time and card commands for the readback,
+  which uses a multiple block read stream.  The card takes the given
+  microseconds per command, 100 by default, and stays busy the given
+  microseconds after each block write, 500 by default.  The image is
+  /tmp/sd_append_bench.img unless given and is formatted for each run.
+
+  Build on Linux with:
+    g++ -O2 -Iarduinolib -o sd_append_bench tools/sd_append_bench.cpp \
+      arduinolib/SD.cpp arduinolib/File.cpp arduinolib/utility/SdVolume.cpp \
+      arduinolib/utility/SdFile.cpp arduinolib/utility/Sd2CardHost.cpp
+*/
+
+#include <SD.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "fat_image.h"
+
+#define IMAGE_BLOCKS	32768			// 16 MB FAT16
+#define RECORD_SIZE		20
+#define RECORDS			2000			// about 78 blocks
+
+enum mode {MODE_WRITE, MODE_WRITE_LAZY, MODE_APPEND_LAZY, MODES};
+
+static const char *modeNames[MODES] = {"write", "write lazy", "append lazy"};
+
+static bool appendRecord(SdFile *f, mode m, const uint8_t *rec)
+{
+	if (m != MODE_APPEND_LAZY)
+	{
+		return f->write(rec, RECORD_SIZE) == RECORD_SIZE;
+	}
+	// a record may straddle two blocks
+	uint16_t done = 0;
+	while (done < RECORD_SIZE)
+	{
+		uint16_t avail;
+		uint8_t *p = f->appendBuffer(&avail);
+		if (!p)
+		{
+			return false;
+		}
+		uint16_t n = RECORD_SIZE - done < avail ? RECORD_SIZE - done : avail;
+		memcpy(p, rec + done, n);
+		if (!f->appendCommit(n))
+		{
+			return false;
+		}
+		done += n;
+	}
+	return true;
+}
+
+static bool run(mode m)
+{
+	Sd2Card card;
+	SdVolume vol;
+	SdFile root, f;
+	if (!makeFatImage(sdHost.image, IMAGE_BLOCKS, 16))
+	{
+		perror(sdHost.image);
+		return false;
+	}
+	SdVolume::cacheClear();
+	if (!card.init(SPI_FULL_SPEED, SD_CHIP_SELECT_PIN) || !vol.init(&card) || !root.openRoot(&vol)
+		|| !f.open(&root, "LOG.BIN", O_RDWR | O_CREAT))
+	{
+		return false;
+	}
+	if (m != MODE_WRITE)
+	{
+		vol.setLazyMetadata();
+	}
+
+	uint8_t rec[RECORD_SIZE];
+	memset(rec, 'r', sizeof(rec));
+	sdStatsReset();
+	uint32_t t = micros();
+	for (uint32_t n = 0; n < RECORDS; n++)
+	{
+		if (!appendRecord(&f, m, rec) || !f.sync())
+		{
+			return false;
+		}
+	}
+	if (!f.close() || !vol.commit())
+	{
+		return false;
+	}
+	t = micros() - t;
+	printf("%-12s append  %6.1f us/record, blocks/record FAT %.3f mirror %.3f dir %.3f data %.3f\n",
+		modeNames[m], (double)t / RECORDS,
+		(double)sdStats.blocksWritten[SD_IO_FAT] / RECORDS,
+		(double)sdStats.blocksWritten[SD_IO_MIRROR] / RECORDS,
+		(double)sdStats.blocksWritten[SD_IO_DIR] / RECORDS,
+		(double)sdStats.blocksWritten[SD_IO_DATA] / RECORDS);
+
+	if (!f.open(&root, "LOG.BIN", O_READ))
+	{
+		return false;
+	}
+	uint8_t buf[512];
+	uint32_t total = 0;
+	int got;
+	sdStatsReset();
+	t = micros();
+	while ((got = f.read(buf, sizeof(buf))) > 0)
+	{
+		total += got;
+	}
+	t = micros() - t;
+	f.close();
+	if (got < 0 || total != (uint32_t)RECORDS * RECORD_SIZE)
+	{
+		return false;
+	}
+	printf("%-12s read    %6.1f us/block, %u commands for %u blocks\n", modeNames[m],
+		(double)t * 512 / total, sdStats.commands, sdStats.blocksRead[SD_IO_DATA]);
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	sdHost.commandMicros = argc > 1 ? atoi(argv[1]) : 100;
+	sdHost.busyMicros = argc > 2 ? atoi(argv[2]) : 500;
+	sdHost.image = argc > 3 ? argv[3] : "/tmp/sd_append_bench.img";
+	for (int m = 0; m < MODES; m++)
+	{
+		if (!run((mode)m))
+		{
+			fprintf(stderr, "%s: failed\n", modeNames[m]);
+			return 1;
+		}
+	}
+	return 0;
+}
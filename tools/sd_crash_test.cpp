@@ -0,0 +1,263 @@
+/*
+  sd_crash_test - power cut tests for the SD library on a card image
+
+  Usage: sd_crash_test [image]
+
+  Appends fixed size records to a log file, syncing after each one,
+  with write() or with appendBuffer() and appendCommit(), and
+  cuts the power after every possible number of block writes in turn
+  with sdHost.writesBeforeCut.  After each cut the card is remounted
+  with SD.begin(), which repairs a volume left dirty in lazy metadata
+  mode, and the test checks that
+    - every record whose sync succeeded is in the file, intact
+    - anything after them is the start of the next records
+    - a file written before the run, with data after its end of file
+      like one from another host, keeps its size
+    - the volume mounts clean and, in lazy mode where the repair covers
+      it, the mirror FAT matches the first FAT
+  Each cut run is a child process that dies with the power, so nothing
+  it had in RAM, the block cache included, survives to the remount.
+  The image, /tmp/sd_crash_test.img by default, is formatted for each
+  run.  Exits with status 1 if any check fails.
+
+  Build on Linux with:
+    g++ -O2 -Iarduinolib -o sd_crash_test tools/sd_crash_test.cpp \
+      arduinolib/SD.cpp arduinolib/File.cpp arduinolib/utility/SdVolume.cpp \
+      arduinolib/utility/SdFile.cpp arduinolib/utility/Sd2CardHost.cpp
+*/
+
+#include <SD.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include "fat_image.h"
+
+#define IMAGE_BLOCKS	32768			// 16 MB FAT16
+#define RECORD_SIZE		20				// does not divide a block, records straddle blocks
+#define RECORDS			120				// fits in an exit status
+#define OLD_SIZE		100				// bytes in the file written before the run
+
+enum mode {MODE_WRITE, MODE_WRITE_LAZY, MODE_APPEND_LAZY, MODES};
+
+static const char *modeNames[MODES] = {"write", "write lazy", "append lazy"};
+
+// never ends in a zero byte, repairSize() would take it for free space
+static void makeRecord(uint32_t n, uint8_t *rec)
+{
+	for (int i = 0; i < RECORD_SIZE; i++)
+	{
+		rec[i] = (uint8_t)(n * 31 + i * 7) | 0x01;
+	}
+}
+
+static bool mount(Sd2Card *card, SdVolume *vol, SdFile *root)
+{
+	return card->init(SPI_FULL_SPEED, SD_CHIP_SELECT_PIN) && vol->init(card) && root->openRoot(vol);
+}
+
+// a file written without lazy mode, then a stray byte after its end
+static bool writeOldFile(SdFile *root)
+{
+	SdFile f;
+	uint8_t buf[OLD_SIZE];
+	memset(buf, 'o', sizeof(buf));
+	uint32_t b0, b1;
+	if (!f.open(root, "OLD.TXT", O_RDWR | O_CREAT) || f.write(buf, sizeof(buf)) != sizeof(buf)
+		|| !f.close() || !f.open(root, "OLD.TXT", O_READ) || !f.contiguousRange(&b0, &b1) || !f.close())
+	{
+		return false;
+	}
+	Sd2Card *card = SdVolume::sdCard();
+	uint8_t block[512];
+	if (!SdVolume::cacheClear() || !card->readBlock(b0, block))
+	{
+		return false;
+	}
+	block[OLD_SIZE + 50] = 'Z';
+	return card->writeBlock(b0, block);
+}
+
+static bool appendRecord(SdFile *f, mode m, uint32_t n)
+{
+	uint8_t rec[RECORD_SIZE];
+	makeRecord(n, rec);
+	if (m != MODE_APPEND_LAZY)
+	{
+		return f->write(rec, RECORD_SIZE) == RECORD_SIZE;
+	}
+	// a record may straddle two blocks
+	uint16_t done = 0;
+	while (done < RECORD_SIZE)
+	{
+		uint16_t avail;
+		uint8_t *p = f->appendBuffer(&avail);
+		if (!p)
+		{
+			return false;
+		}
+		uint16_t len = RECORD_SIZE - done < avail ? RECORD_SIZE - done : avail;
+		memcpy(p, rec + done, len);
+		if (!f->appendCommit(len))
+		{
+			return false;
+		}
+		done += len;
+	}
+	return true;
+}
+
+// runs the workload, returns the records synced before the power went
+static uint32_t workload(mode m, uint32_t cut, uint32_t *writes)
+{
+	Sd2Card card;
+	SdVolume vol;
+	SdFile root, f;
+	if (!mount(&card, &vol, &root) || !writeOldFile(&root))
+	{
+		fprintf(stderr, "setup failed\n");
+		exit(1);
+	}
+	if (m != MODE_WRITE)
+	{
+		vol.setLazyMetadata();
+	}
+	uint32_t start = sdHost.writeCount;
+	sdHost.writesBeforeCut = cut ? start + cut : 0;
+	uint32_t synced = 0;
+	if (f.open(&root, "LOG.BIN", O_RDWR | O_CREAT))
+	{
+		while (synced < RECORDS && appendRecord(&f, m, synced) && f.sync())
+		{
+			synced++;
+		}
+	}
+	if (!cut)
+	{
+		f.close();
+		vol.commit();
+	}
+	*writes = sdHost.writeCount - start;
+	sdHost.writesBeforeCut = 0;
+	return synced;
+}
+
+// the workload in a child that exits at the cut, returns the records synced
+static uint32_t cutRun(mode m, uint32_t cut)
+{
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		uint32_t writes;
+		_exit(workload(m, cut, &writes));
+	}
+	int status;
+	if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status))
+	{
+		fprintf(stderr, "cut run failed\n");
+		exit(1);
+	}
+	return WEXITSTATUS(status);
+}
+
+static bool sameBlocks(Sd2Card *card, uint32_t a, uint32_t b)
+{
+	uint8_t x[512], y[512];
+	return card->readBlock(a, x) && card->readBlock(b, y) && !memcmp(x, y, 512);
+}
+
+static const char *check(mode m, uint32_t synced)
+{
+	// the image was rewritten behind the cache
+	SdVolume::cacheClear();
+	if (!SD.begin(SD_CHIP_SELECT_PIN))
+	{
+		return "remount failed";
+	}
+	File old = SD.open("OLD.TXT");
+	uint32_t oldSize = old.size();
+	old.close();
+	if (oldSize != OLD_SIZE)
+	{
+		return "file from before the run changed size";
+	}
+	File log = SD.open("LOG.BIN");
+	if (!log && synced)
+	{
+		return "log file lost";
+	}
+	uint32_t size = log ? log.size() : 0;
+	if (size < synced * RECORD_SIZE)
+	{
+		log.close();
+		return "synced records lost";
+	}
+	for (uint32_t n = 0; n * RECORD_SIZE < size; n++)
+	{
+		uint8_t rec[RECORD_SIZE], want[RECORD_SIZE];
+		uint32_t len = size - n * RECORD_SIZE < RECORD_SIZE ? size - n * RECORD_SIZE : RECORD_SIZE;
+		makeRecord(n, want);
+		if (log.read(rec, len) != (int)len || memcmp(rec, want, len))
+		{
+			log.close();
+			return "bad record data";
+		}
+	}
+	log.close();
+
+	// a fresh volume object so nothing is kept from the workload
+	Sd2Card card;
+	SdVolume vol;
+	if (!card.init(SPI_FULL_SPEED, SD_CHIP_SELECT_PIN) || !vol.init(&card))
+	{
+		return "volume check mount failed";
+	}
+	if (vol.uncleanMount())
+	{
+		return "volume still dirty after repair";
+	}
+	// without lazy mode a cut between the two FAT writes is not detected
+	for (uint32_t i = 0; m != MODE_WRITE && i < vol.blocksPerFat(); i++)
+	{
+		if (!sameBlocks(&card, vol.fatStartBlock() + i, vol.fatStartBlock() + vol.blocksPerFat() + i))
+		{
+			return "mirror FAT differs";
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	sdHost.image = argc > 1 ? argv[1] : "/tmp/sd_crash_test.img";
+	int failed = 0;
+	for (int m = 0; m < MODES; m++)
+	{
+		// writes in a run without a cut
+		if (!makeFatImage(sdHost.image, IMAGE_BLOCKS, 16))
+		{
+			perror(sdHost.image);
+			return 1;
+		}
+		uint32_t writes;
+		workload((mode)m, 0, &writes);
+		const char *err = check((mode)m, RECORDS);
+
+		uint32_t cuts = 0;
+		for (uint32_t cut = 1; !err && cut <= writes; cut++)
+		{
+			makeFatImage(sdHost.image, IMAGE_BLOCKS, 16);
+			uint32_t synced = cutRun((mode)m, cut);
+			cuts++;
+			if ((err = check((mode)m, synced)) != 0)
+			{
+				fprintf(stderr, "%s: cut after %u writes, %u records synced: %s\n",
+					modeNames[m], cut, synced, err);
+			}
+		}
+		printf("%-12s %s, %u power cuts, %u writes per run\n",
+			modeNames[m], err ? "FAIL" : "pass", cuts, writes);
+		failed |= err != 0;
+	}
+	return failed;
+}
@@ -0,0 +1,250 @@
+/*
+  trace_decode - turn captured trace frames into a timeline and latencies
+
+  Usage: trace_decode <capture file> [-q]
+
+  Scans a capture of the radio link (anything, text included) for the
+  frames sent by the 'b' command (see src/Trace.h), checks their CRC and
+  prints every event as "t us<TAB>delta us<TAB>event<TAB>arg", then a
+  histogram per span in power of two microsecond buckets.  -q leaves out
+  the timeline.  Spans are paired inside one frame only, and time does
+  not run while the meter sleeps, so a SLEEP to WAKE gap is counted as
+  a sleep and not added to any span.
+
+  Build on Linux with: g++ -O2 -o trace_decode tools/trace_decode.cpp
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+// frame layout and event ids, see src/Trace.h
+#define TRACE_HEADER_SIZE	5
+#define TRACE_ENTRY_SIZE	6
+
+enum traceEvent
+{
+	TRACE_ISR = 1,
+	TRACE_WAKE,
+	TRACE_SLEEP,
+	TRACE_RTC_BEGIN,
+	TRACE_RTC_END,
+	TRACE_EEPROM_WRITE,
+	TRACE_SD_BEGIN,
+	TRACE_SD_END,
+	TRACE_TX_BEGIN,
+	TRACE_TX_END,
+	TRACE_EVENTS
+};
+
+static const char *eventNames[TRACE_EVENTS] =
+{
+	"?", "ISR", "WAKE", "SLEEP", "RTC_BEGIN", "RTC_END",
+	"EEPROM_WRITE", "SD_BEGIN", "SD_END", "TX_BEGIN", "TX_END"
+};
+
+enum span {SPAN_RTC, SPAN_SD, SPAN_TX, SPAN_AWAKE, SPAN_ISR_WAKE, SPAN_SLEEPS};
+
+static const char *spanNames[SPAN_SLEEPS] = {"RTC read", "SD write", "radio TX", "awake", "ISR to wake"};
+
+#define BUCKETS		32
+
+struct histogram
+{
+	uint32_t count[BUCKETS];
+	uint32_t n;
+	uint64_t total;
+	uint32_t max;
+};
+
+static histogram spans[SPAN_SLEEPS];
+static uint32_t sleeps;
+
+struct entry
+{
+	uint32_t micros;
+	uint8_t id;
+	uint8_t arg;
+};
+
+// same as avr-libc _crc16_update
+static uint16_t crc16Update(uint16_t crc, uint8_t a)
+{
+	crc ^= a;
+	for (int i = 0; i < 8; i++)
+	{
+		crc = crc & 1 ? (crc >> 1) ^ 0xA001 : crc >> 1;
+	}
+	return crc;
+}
+
+static void addSpan(span s, uint32_t us)
+{
+	histogram *h = &spans[s];
+	int b = 0;
+	while (b < BUCKETS - 1 && (1UL << (b + 1)) <= us)
+	{
+		b++;
+	}
+	h->count[b]++;
+	h->n++;
+	h->total += us;
+	if (us > h->max)
+	{
+		h->max = us;
+	}
+}
+
+// pairs begin and end events, time only runs while awake
+static void measure(const std::vector<entry> &ev)
+{
+	bool open[SPAN_SLEEPS] = {false};
+	uint32_t start[SPAN_SLEEPS];
+	bool asleep = false;
+	for (size_t i = 0; i < ev.size(); i++)
+	{
+		const entry &e = ev[i];
+		span begin = SPAN_SLEEPS, end = SPAN_SLEEPS;
+		switch (e.id)
+		{
+		case TRACE_RTC_BEGIN: begin = SPAN_RTC; break;
+		case TRACE_RTC_END: end = SPAN_RTC; break;
+		case TRACE_SD_BEGIN: begin = SPAN_SD; break;
+		case TRACE_SD_END: end = SPAN_SD; break;
+		case TRACE_TX_BEGIN: begin = SPAN_TX; break;
+		case TRACE_TX_END: end = SPAN_TX; break;
+		case TRACE_ISR:
+			if (!open[SPAN_ISR_WAKE])
+			{
+				begin = SPAN_ISR_WAKE;
+			}
+			break;
+		case TRACE_SLEEP:
+			end = SPAN_AWAKE;
+			asleep = true;
+			break;
+		case TRACE_WAKE:
+			if (asleep)
+			{
+				sleeps++;
+			}
+			asleep = false;
+			end = SPAN_ISR_WAKE;
+			begin = SPAN_AWAKE;
+			break;
+		}
+		if (end != SPAN_SLEEPS && open[end])
+		{
+			addSpan(end, e.micros - start[end]);
+			open[end] = false;
+		}
+		if (begin != SPAN_SLEEPS)
+		{
+			open[begin] = true;
+			start[begin] = e.micros;
+		}
+		if (e.id == TRACE_SLEEP)
+		{
+			// a span across a sleep has no meaningful length
+			memset(open, 0, sizeof(open));
+		}
+	}
+}
+
+static void printHistogram(span s)
+{
+	const histogram *h = &spans[s];
+	printf("%s: %u, mean %.0f us, max %u us\n", spanNames[s], h->n,
+		h->n ? (double)h->total / h->n : 0.0, h->max);
+	for (int b = 0; b < BUCKETS; b++)
+	{
+		if (h->count[b])
+		{
+			printf("  %10lu us+\t%u\n", b ? 1UL << b : 0UL, h->count[b]);
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2)
+	{
+		fprintf(stderr, "usage: %s <capture file> [-q]\n", argv[0]);
+		return 2;
+	}
+	bool quiet = argc > 2 && !strcmp(argv[2], "-q");
+	FILE *f = fopen(argv[1], "rb");
+	if (!f)
+	{
+		perror(argv[1]);
+		return 1;
+	}
+	std::vector<uint8_t> cap;
+	uint8_t buf[4096];
+	size_t got;
+	while ((got = fread(buf, 1, sizeof(buf), f)) > 0)
+	{
+		cap.insert(cap.end(), buf, buf + got);
+	}
+	fclose(f);
+
+	uint32_t frames = 0, bad = 0;
+	for (size_t at = 0; at + TRACE_HEADER_SIZE + 2 <= cap.size(); at++)
+	{
+		const uint8_t *p = &cap[at];
+		if (p[0] != 'T' || p[1] != 'R' || p[2] != 'C' || p[4] != TRACE_ENTRY_SIZE)
+		{
+			continue;
+		}
+		size_t len = TRACE_HEADER_SIZE + p[3] * TRACE_ENTRY_SIZE + 2;
+		if (at + len > cap.size())
+		{
+			continue;
+		}
+		const uint8_t *q = p + TRACE_HEADER_SIZE;
+		uint16_t crc = 0xFFFF;
+		for (size_t i = 0; i < (size_t)p[3] * TRACE_ENTRY_SIZE; i++)
+		{
+			crc = crc16Update(crc, q[i]);
+		}
+		if ((q[len - TRACE_HEADER_SIZE - 2] | q[len - TRACE_HEADER_SIZE - 1] << 8) != crc)
+		{
+			fprintf(stderr, "bad CRC in frame at offset %zu\n", at);
+			bad++;
+			continue;
+		}
+
+		std::vector<entry> ev(p[3]);
+		for (size_t i = 0; i < ev.size(); i++, q += TRACE_ENTRY_SIZE)
+		{
+			ev[i].micros = q[0] | q[1] << 8 | q[2] << 16 | (uint32_t)q[3] << 24;
+			ev[i].id = q[4];
+			ev[i].arg = q[5];
+		}
+		if (!quiet)
+		{
+			printf("frame %u at offset %zu, %u events\n", frames, at, (uint32_t)ev.size());
+			for (size_t i = 0; i < ev.size(); i++)
+			{
+				uint32_t delta = i ? ev[i].micros - ev[i - 1].micros : 0;
+				const char *name = ev[i].id < TRACE_EVENTS ? eventNames[ev[i].id] : "?";
+				printf("%u\t%u\t%s\t%u\n", ev[i].micros, delta, name, ev[i].arg);
+			}
+		}
+		measure(ev);
+		frames++;
+		at += len - 1;
+	}
+
+	if (!quiet && frames)
+	{
+		printf("\n");
+	}
+	for (int s = 0; s < SPAN_SLEEPS; s++)
+	{
+		printHistogram((span)s);
+	}
+	fprintf(stderr, "%u frames, %u bad, %u sleeps\n", frames, bad, sleeps);
+	return 0;
+}